@@ -24,15 +24,56 @@
 
 #include "filesystem.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <algorithm>
 #include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#if defined(__linux__) && defined(STATX_TYPE)
+#define FS_HAVE_STATX
+#include <sys/sysmacros.h>
+#endif
+
+// io_uring is used without liburing, only the kernel header is needed.
+// Define FS_NO_IO_URING to build without it.
+#if defined(FS_HAVE_STATX) && !defined(FS_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__linux__) && !defined(FS_NO_GETDENTS)
+#define FS_HAVE_GETDENTS
+#include <sys/syscall.h>
+#endif
+
+#ifdef __linux__
+#include <map>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
 #ifdef _WIN32
 
 #include <Windows.h>
@@ -41,6 +82,14 @@
 #define lstat(A,B) stat(A,B)
 #define mkdir(PATH,MODE) _mkdir(PATH)
 
+// there are no *at() functions, so only AT_FDCWD can be supported
+#define AT_FDCWD -100
+#define AT_SYMLINK_NOFOLLOW 0x100
+#define AT_REMOVEDIR 0x200
+#define fstatat(FD,PATH,ST,FLAGS) stat(PATH,ST)
+#define mkdirat(FD,PATH,MODE) _mkdir(PATH)
+#define unlinkat(FD,PATH,FLAGS) (((FLAGS) & AT_REMOVEDIR) ? _rmdir(PATH) : _unlink(PATH))
+
 #endif
 
 static auto is_slash(char c) -> bool
@@ -52,23 +101,55 @@ static auto is_slash(char c) -> bool
 #endif
 }
 
-static auto last_slash(const std::string& s) -> size_t
+static auto last_of(const char *s, size_t n, char c) -> size_t
+{
+	while(n > 0){
+		if(s[--n] == c)
+			return n;
+	}
+	return std::string::npos;
+}
+
+static auto last_slash(const char *s, size_t n) -> size_t
 {
-	size_t i = s.rfind('/');
+	size_t i = last_of(s, n, '/');
 #ifdef _WIN32
-	size_t j = s.rfind('\\');
-	if(j != std::string::npos && j > i) i = j;
+	size_t j = last_of(s, n, '\\');
+	if(j != std::string::npos && (i == std::string::npos || j > i)) i = j;
 #endif
 	return i;
 }
 
-static auto forward_slashes(std::string& s) -> void
+// Compares two paths component by component, so that redundant (repeated
+// or trailing) separators do not matter. Rooted paths sort before relative
+// ones.
+static auto lexical_compare(const char *a, size_t an, const char *b, size_t bn) -> int
 {
-#ifdef _WIN32
-	for(auto& c : s)
-		if(c == '\\')
-			c = '/';
-#endif
+	const bool ra = an > 0 && is_slash(a[0]);
+	const bool rb = bn > 0 && is_slash(b[0]);
+	if(ra != rb)
+		return ra ? -1 : 1;
+
+	size_t i = 0, j = 0;
+	for(;;){
+		while(i < an && is_slash(a[i])) i++;
+		while(j < bn && is_slash(b[j])) j++;
+		if(i == an || j == bn)
+			return (i == an ? 0 : 1) - (j == bn ? 0 : 1);
+
+		size_t ie = i, je = j;
+		while(ie < an && !is_slash(a[ie])) ie++;
+		while(je < bn && !is_slash(b[je])) je++;
+
+		const size_t al = ie-i, bl = je-j;
+		const int c = memcmp(a+i, b+j, al < bl ? al : bl);
+		if(c != 0)
+			return c;
+		if(al != bl)
+			return al < bl ? -1 : 1;
+		i = ie;
+		j = je;
+	}
 }
 
 static auto currentdir(char *buf, size_t len) -> bool
@@ -83,113 +164,357 @@ static auto currentdir(char *buf, size_t len) -> bool
 
 namespace boostfs{
 
+path_view::path_view()
+	: ptr(""), len(0)
+{
+}
+path_view::path_view(const char *s2, size_t n)
+	: ptr(s2), len(n)
+{
+}
+path_view::path_view(const char *s2)
+	: ptr(s2), len(strlen(s2))
+{
+}
+path_view::path_view(const Path& p)
+	: ptr(p.c_str()), len(p.size())
+{
+}
+auto path_view::data() const -> const char*
+{
+	return ptr;
+}
+auto path_view::size() const -> size_t
+{
+	return len;
+}
+auto path_view::empty() const -> bool
+{
+	return len == 0;
+}
+auto path_view::string() const -> std::string
+{
+	return std::string(ptr, len);
+}
+auto path_view::operator==(const path_view& v) const -> bool
+{
+	return len == v.len && memcmp(ptr, v.ptr, len) == 0;
+}
+auto path_view::operator!=(const path_view& v) const -> bool
+{
+	return !(*this == v);
+}
+auto path_view::operator==(const char *s2) const -> bool
+{
+	return strncmp(ptr, s2, len) == 0 && s2[len] == '\0';
+}
+auto path_view::operator!=(const char *s2) const -> bool
+{
+	return !(*this == s2);
+}
+
 Path::Path()
+	: buf(sbuf), len(0), cap(FS_PATH_BUFSIZE), sep_pos(std::string::npos), dot_pos(std::string::npos)
+{
+	sbuf[0] = '\0';
+}
+
+Path::Path(const std::string& s2) : Path(s2.data(), s2.size())
 {
 }
 
-Path::Path(std::string s2) : s(s2)
+Path::Path(const char *s2) : Path(s2, strlen(s2))
+{
+}
+Path::Path(const char *s2, size_t n) : Path()
+{
+	assign(s2, n);
+}
+Path::Path(const path_view& v) : Path(v.data(), v.size())
+{
+}
+Path::Path(const Path& p) : Path()
+{
+	*this = p;
+}
+Path::Path(Path&& p) : Path()
+{
+	*this = std::move(p);
+}
+Path::~Path()
+{
+	if(buf != sbuf)
+		delete[] buf;
+}
+
+// updates sep_pos and dot_pos for the characters from offset from on
+auto Path::scan(size_t from) -> void
+{
+	const size_t s = last_slash(buf+from, len-from);
+	if(s != std::string::npos){
+		sep_pos = from+s;
+		dot_pos = std::string::npos;
+		from = sep_pos+1;
+	}
+	const size_t d = last_of(buf+from, len-from, '.');
+	if(d != std::string::npos)
+		dot_pos = from+d;
+}
+auto Path::ext_pos() const -> size_t
 {
+	if(dot_pos == std::string::npos)
+		return dot_pos;
+	const size_t f = sep_pos == std::string::npos ? 0 : sep_pos+1;
+	// "." and ".." have no extension
+	if(len-f <= 2 && dot_pos == len-1 && (len-f == 1 || buf[f] == '.'))
+		return std::string::npos;
+	return dot_pos;
 }
 
-Path::Path(const char *s2) : s(s2)
+// make room for n characters plus the terminating null byte
+auto Path::reserve(size_t n) -> void
 {
+	if(n < cap)
+		return;
+	size_t c = cap*2;
+	if(c <= n)
+		c = n+1;
+	char *b = new char[c];
+	memcpy(b, buf, len+1);
+	if(buf != sbuf)
+		delete[] buf;
+	buf = b;
+	cap = c;
 }
-Path::Path(const Path& p)
+auto Path::assign(const char *s2, size_t n) -> void
 {
-	s = p.s;
+	reserve(n);
+	memmove(buf, s2, n);
+	buf[n] = '\0';
+	len = n;
+	sep_pos = dot_pos = std::string::npos;
+	scan(0);
 }
-Path::Path(Path&& p)
+auto Path::append(const char *s2, size_t n) -> void
 {
-	s = std::move(p.s);
+	// s2 may point into our own buffer, which reserve() could free
+	const bool self = s2 >= buf && s2 <= buf+len;
+	const size_t off = self ? s2-buf : 0;
+	reserve(len+n);
+	if(self)
+		s2 = buf+off;
+	memcpy(buf+len, s2, n);
+	const size_t old = len;
+	len += n;
+	buf[len] = '\0';
+	scan(old);
+}
+auto Path::truncate(size_t n) -> void
+{
+	if(n < len){
+		len = n;
+		buf[len] = '\0';
+		if(sep_pos != std::string::npos && sep_pos >= n){
+			sep_pos = dot_pos = std::string::npos;
+			scan(0);
+		}else if(dot_pos != std::string::npos && dot_pos >= n){
+			const size_t f = sep_pos == std::string::npos ? 0 : sep_pos+1;
+			dot_pos = std::string::npos;
+			scan(f);
+		}
+	}
 }
 
 auto Path::operator+(const Path& p) const -> Path
 {
-	return s+p.s;
+	Path r;
+	r.reserve(len+p.len);
+	r.append(buf, len);
+	r.append(p.buf, p.len);
+	return r;
 }
 auto Path::operator/(const Path& p) const -> Path
 {
-	if(is_slash(s.back()))
-		return s+p.s;
-	return s+"/"+p.s;
+	Path r;
+	r.reserve(len+1+p.len);
+	r.append(buf, len);
+	r /= p;
+	return r;
 }
 auto Path::operator==(const Path& p) const -> bool
 {
-	return strcmp(canonical(s).c_str(),canonical(p.s).c_str()) == 0;
+	return lexical_compare(buf, len, p.buf, p.len) == 0;
 }
 auto Path::operator!=(const Path& p) const -> bool
 {
 	return !(*this == p);
 }
+auto Path::operator<(const Path& p) const -> bool
+{
+	return lexical_compare(buf, len, p.buf, p.len) < 0;
+}
 auto Path::parent_path() const -> Path
 {
-	size_t i = last_slash(s);
+	return parent_path_view();
+}
+auto Path::parent_path_view() const -> path_view
+{
+	size_t i = sep_pos;
 	if(i == std::string::npos){
-		return "";
+		return path_view();
 	}
 #ifdef _WIN32
-	if(isalpha(s[0]) && s[1] == ':' && i == 2){
-		return s.substr(0,3);
+	if(isalpha(buf[0]) && buf[1] == ':' && i == 2){
+		return path_view(buf, 3);
 	}
 #else
 	if(i == 0){
-		return "/";
+		return path_view(buf, 1);
 	}
 #endif
-	return s.substr(0,i);
+	return path_view(buf, i);
+}
+// Removes "." components, redundant separators and "name/.." pairs in a
+// single pass. The output buffer doubles as the stack of components: a
+// ".." truncates it back to the previous separator. ".." at the start of
+// a relative path is kept, at the root it is dropped. Separators in the
+// result are always forward slashes.
+auto Path::lexically_normal() const -> Path
+{
+	Path r;
+	r.reserve(len+1);
+
+	size_t i = 0;
+#ifdef _WIN32
+	if(len >= 2 && isalpha(buf[0]) && buf[1] == ':'){
+		r.append(buf, 2);
+		i = 2;
+	}
+#endif
+	const bool rooted = i < len && is_slash(buf[i]);
+	if(rooted)
+		r.append("/", 1);
+	const size_t root = r.len;
+
+	while(i < len){
+		while(i < len && is_slash(buf[i])) i++;
+		size_t e = i;
+		while(e < len && !is_slash(buf[e])) e++;
+		const size_t n = e-i;
+		if(n == 0)
+			break;
+
+		if(n == 2 && buf[i] == '.' && buf[i+1] == '.'){
+			size_t top = last_slash(r.buf+root, r.len-root);
+			top = top == std::string::npos ? root : root+top;
+			const size_t start = top == root ? root : top+1;
+			const bool top_dotdot = r.len-start == 2 && r.buf[start] == '.' && r.buf[start+1] == '.';
+			if(r.len > root && !top_dotdot){
+				r.truncate(top);
+				i = e;
+				continue;
+			}
+			if(rooted){
+				i = e;
+				continue;
+			}
+		}else if(n == 1 && buf[i] == '.'){
+			i = e;
+			continue;
+		}
+
+		if(r.len > root)
+			r.append("/", 1);
+		r.append(buf+i, n);
+		i = e;
+	}
+
+	if(r.len == 0)
+		r.append(".", 1);
+	return r;
 }
 auto Path::clear() -> void
 {
-	s.clear();
+	truncate(0);
 }
 auto Path::empty() const -> bool
 {
-	return s.empty();
+	return len == 0;
 }
 auto Path::operator=(const Path& p) -> Path&
 {
-	s = p.s;
+	if(this == &p)
+		return *this;
+	assign(p.buf, p.len);
 	return *this;
 }
 auto Path::operator=(Path&& p) -> Path&
 {
-	s = std::move(p.s);
+	if(this == &p)
+		return *this;
+	if(p.buf != p.sbuf){
+		// steal the heap buffer
+		if(buf != sbuf)
+			delete[] buf;
+		buf = p.buf;
+		len = p.len;
+		cap = p.cap;
+		p.buf = p.sbuf;
+		p.cap = FS_PATH_BUFSIZE;
+	}else{
+		assign(p.buf, p.len);
+	}
+	sep_pos = p.sep_pos;
+	dot_pos = p.dot_pos;
+	p.len = 0;
+	p.buf[0] = '\0';
+	p.sep_pos = p.dot_pos = std::string::npos;
 	return *this;
 }
 auto Path::operator+=(const Path& p) -> Path&
 {
-	s += p.s;
+	append(p.buf, p.len);
 	return *this;
 }
 auto Path::operator/=(const Path& p) -> Path&
 {
-	if(is_slash(s.back()))
-		s += p.s;
-	else
-		s += "/" +p.s;
+	const size_t n = p.len;
+	if(len > 0 && !is_slash(buf[len-1]))
+		append("/", 1);
+	append(p.buf, n);
 	return *this;
 }
 auto Path::filename() const -> Path
 {
-	size_t i = last_slash(s);
-	if(i == std::string::npos)
-		return *this;
-	return s.substr(i+1);
+	return filename_view();
 }
 auto Path::extension() const -> Path
 {
-	size_t i = s.rfind('.');
-	if(i == std::string::npos)
-		return "";
-	return s.substr(i);
+	return extension_view();
 }
 auto Path::stem() const -> Path
 {
-	auto st = filename();
-	size_t i = s.rfind('.');
-	if(i == std::string::npos)
-		return s;
-	return s.substr(0, i);
+	return stem_view();
+}
+auto Path::filename_view() const -> path_view
+{
+	if(sep_pos == std::string::npos)
+		return *this;
+	return path_view(buf+sep_pos+1, len-sep_pos-1);
+}
+auto Path::extension_view() const -> path_view
+{
+	const size_t e = ext_pos();
+	if(e == std::string::npos)
+		return path_view();
+	return path_view(buf+e, len-e);
+}
+auto Path::stem_view() const -> path_view
+{
+	const size_t f = sep_pos == std::string::npos ? 0 : sep_pos+1;
+	const size_t x = ext_pos();
+	const size_t e = x == std::string::npos ? len : x;
+	return path_view(buf+f, e-f);
 }
 auto operator+(const std::string& s, const Path& p) -> Path
 {
@@ -203,87 +528,244 @@ auto operator==(const std::string& s, const Path& p) -> bool
 {
 	return p == s;
 }
+// FNV-1a over the path with runs of separators folded into one and a
+// trailing separator dropped, consistent with operator==
+auto hash_value(const Path& p) -> size_t
+{
+	const char *s = p.c_str();
+	const size_t n = p.size();
+	uint64_t h = 14695981039346656037ull;
+	bool sep = false;
+	for(size_t i = 0; i < n; i++){
+		if(is_slash(s[i])){
+			sep = true;
+			continue;
+		}
+		if(sep || i == 0){
+			// component boundary; the root is distinct from a relative start
+			h = (h ^ uint8_t(sep ? '/' : 0)) * 1099511628211ull;
+			sep = false;
+		}
+		h = (h ^ uint8_t(s[i])) * 1099511628211ull;
+	}
+	if(sep && n > 0 && is_slash(s[0]) && h == 14695981039346656037ull)
+		h = (h ^ uint8_t('/')) * 1099511628211ull;
+	return size_t(h);
+}
 
 auto Path::size() const -> size_t
 {
-	return s.size();
+	return len;
 }
-auto Path::string() const -> const std::string&
+auto Path::string() const -> std::string
 {
-	return s;
+	return std::string(buf, len);
 }
 auto Path::c_str() const -> const char*
 {
-	return s.c_str();
+	return buf;
 }
 
 auto Path::replace_extension(const Path& p) -> void
 {
-	size_t i = s.rfind('.');
-	if(i != std::string::npos){
-		s.erase(i);
+	const size_t e = ext_pos();
+	if(e != std::string::npos){
+		truncate(e);
 	}
-	if(!p.s.empty() && p.s[0] != '.'){
-		s += '.';
+	if(p.len > 0 && p.buf[0] != '.'){
+		append(".", 1);
 	}
-	s += p.s;
+	append(p.buf, p.len);
 }
 
-auto exists(const Path& p) -> bool
+static auto type_of(mode_t m) -> file_type
 {
-	struct stat st;
-	return lstat(p.c_str(), &st) == 0;
+	if(S_ISREG(m)) return regular_file;
+	if(S_ISDIR(m)) return directory_file;
+#ifndef _WIN32
+	if(S_ISLNK(m)) return symlink_file;
+	if(S_ISBLK(m)) return block_file;
+	if(S_ISFIFO(m)) return fifo_file;
+	if(S_ISSOCK(m)) return socket_file;
+#endif
+	if(S_ISCHR(m)) return character_file;
+	return type_unknown;
 }
-auto remove(const Path& p) -> bool
+
+static auto mtime_of(const struct stat& st) -> file_time
 {
-#ifndef FS_DRYRUN
-	if(is_directory(p))
-		return rmdir(p.c_str()) == 0;
-	return unlink(p.c_str()) == 0;
+#if defined(_WIN32)
+	return file_time(std::chrono::seconds(st.st_mtime));
+#elif defined(__APPLE__)
+	return file_time(std::chrono::seconds(st.st_mtimespec.tv_sec) + std::chrono::nanoseconds(st.st_mtimespec.tv_nsec));
 #else
-	if(is_directory(p))
-		fprintf(stderr, "rmdir %s\n", p.c_str());
-	else
-		fprintf(stderr, "unlink %s\n", p.c_str());
-	return true;
+	return file_time(std::chrono::seconds(st.st_mtim.tv_sec) + std::chrono::nanoseconds(st.st_mtim.tv_nsec));
 #endif
 }
-auto remove_all(const Path& p) -> bool
+
+// a missing file is not an error, everything else is
+static auto status_from_error(int err) -> file_status
+{
+	if(err == ENOENT || err == ENOTDIR)
+		return file_status(file_not_found);
+	return file_status(status_error);
+}
+static auto set_error(std::error_code& ec, int err) -> void
+{
+	ec.assign(err, std::generic_category());
+}
+static auto check(const std::error_code& ec, const char *what, const Path& p) -> void
+{
+	if(ec)
+		throw std::system_error(ec, std::string(what) + p.c_str());
+}
+
+file_status::file_status()
+	: file_status(status_error)
+{
+}
+file_status::file_status(file_type t2)
+	: t(t2), valid(0), perms(0), sz(0), mtime(), btime(), dev(0), ino(0), nlink(0)
 {
-	if(!is_directory(p))
-		return unlink(p.c_str()) == 0;
+}
+file_status::file_status(const struct stat& st)
+	: t(type_of(st.st_mode)), valid(status_basic), perms(st.st_mode & 07777), sz(st.st_size),
+	mtime(mtime_of(st)), btime(), dev(st.st_dev), ino(st.st_ino), nlink(st.st_nlink)
+{
+}
+#ifdef FS_HAVE_STATX
+static auto to_file_time(const struct statx_timestamp& ts) -> file_time
+{
+	return file_time(std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec));
+}
 
-	std::vector<std::pair<directory_iterator,Path>> moredirs;
-	std::vector<std::pair<directory_iterator,Path>> dirstack;
-	dirstack.push_back(std::make_pair(directory_iterator(p), p));
+file_status::file_status(const struct statx& stx)
+	: file_status(type_of(stx.stx_mode))
+{
+	const unsigned m = stx.stx_mask;
+	valid = status_type;
+	dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	if(m & STATX_MODE){
+		valid |= status_permissions;
+		perms = stx.stx_mode & 07777;
+	}
+	if(m & STATX_SIZE){
+		valid |= status_size;
+		sz = stx.stx_size;
+	}
+	if(m & STATX_MTIME){
+		valid |= status_mtime;
+		mtime = to_file_time(stx.stx_mtime);
+	}
+	if(m & STATX_BTIME){
+		valid |= status_btime;
+		btime = to_file_time(stx.stx_btime);
+	}
+	if(m & STATX_INO){
+		valid |= status_ids;
+		ino = stx.stx_ino;
+	}
+	if(m & STATX_NLINK){
+		valid |= status_nlink;
+		nlink = stx.stx_nlink;
+	}
+}
 
-	const auto end_it = directory_iterator();
+static auto statx_mask(unsigned fields) -> unsigned
+{
+	unsigned m = STATX_TYPE;
+	if(fields & status_permissions) m |= STATX_MODE;
+	if(fields & status_size) m |= STATX_SIZE;
+	if(fields & status_mtime) m |= STATX_MTIME;
+	if(fields & status_btime) m |= STATX_BTIME;
+	if(fields & status_ids) m |= STATX_INO;
+	if(fields & status_nlink) m |= STATX_NLINK;
+	return m;
+}
+#endif
+auto file_status::fields() const -> unsigned
+{
+	return valid;
+}
+auto file_status::type() const -> file_type
+{
+	return t;
+}
+auto file_status::permissions() const -> mode_t
+{
+	return perms;
+}
+auto file_status::size() const -> uintmax_t
+{
+	return sz;
+}
+auto file_status::last_write_time() const -> file_time
+{
+	return mtime;
+}
+auto file_status::creation_time() const -> file_time
+{
+	return btime;
+}
+auto file_status::device() const -> dev_t
+{
+	return dev;
+}
+auto file_status::inode() const -> ino_t
+{
+	return ino;
+}
+auto file_status::hard_link_count() const -> nlink_t
+{
+	return nlink;
+}
 
-	while(dirstack.size() > 0){
-		// take reference of dirstack, so we must not modify the vector
-		auto& dir = dirstack.back();
+auto exists(const file_status& st) -> bool
+{
+	return st.type() != status_error && st.type() != file_not_found;
+}
+auto is_regular_file(const file_status& st) -> bool
+{
+	return st.type() == regular_file;
+}
+auto is_directory(const file_status& st) -> bool
+{
+	return st.type() == directory_file;
+}
+auto is_symlink(const file_status& st) -> bool
+{
+	return st.type() == symlink_file;
+}
 
-		for(; dir.first != end_it; ++dir.first){
-			auto p2 = (*dir.first).path();
-			if(p2.filename() == "." || p2.filename() == "..")
-				continue;
-			if(is_directory(p2)){
-				moredirs.emplace_back(directory_iterator(p2),p2);
-			}else{
-				if(!remove(p2))
-					return false;
-			}
-		}
+namespace{
 
-		if(moredirs.empty()){
-			remove(dir.second);
-			dirstack.pop_back();
-		}else{
-			dirstack.resize(dirstack.size() + moredirs.size());
-			std::move(std::begin(moredirs), std::end(moredirs), std::begin(dirstack)+dirstack.size());
-		}
-	}
-	return true;
+auto cwd_dir() -> const working_dir&
+{
+	static const working_dir d;
+	return d;
+}
+
+}
+
+auto status(const Path& p, unsigned fields) -> file_status
+{
+	return status(cwd_dir(), p, fields);
+}
+auto symlink_status(const Path& p, unsigned fields) -> file_status
+{
+	return symlink_status(cwd_dir(), p, fields);
+}
+auto exists(const Path& p) -> bool
+{
+	return exists(cwd_dir(), p);
+}
+auto remove(const Path& p) -> bool
+{
+	return remove(cwd_dir(), p);
+}
+auto remove_all(const Path& p) -> bool
+{
+	return remove_all(cwd_dir(), p);
 }
 auto extension(const Path& p) -> Path
 {
@@ -292,159 +774,3110 @@ auto extension(const Path& p) -> Path
 
 auto complete(const Path& p) -> Path
 {
-	constexpr int N = 4096;
-	char buf[N];
-	auto s = p.string();
-#ifdef _WIN32
-	if(p.size() >= 3 && isalpha(s[0]) && s[1] == ':' && is_slash(s[2]))
-		return p;
-#else
-	if(p.size() > 0 && is_slash(s[0]))
-		return p;
-#endif
-	if(!currentdir(buf, N))
-		throw std::runtime_error("could not obtain current working directory");
-
-	if(p.empty())
-		return buf;
-	return buf / p;
+	std::error_code ec;
+	auto r = complete(p, ec);
+	if(ec)
+		throw std::system_error(ec, "cannot retrieve current directory");
+	return r;
 }
 auto canonical(const Path& p)-> Path
 {
-	auto s = complete(p).string();
-	forward_slashes(s);
-	size_t pos = 1;
-	while((pos = s.find('.', pos)) != std::string::npos){
-		if(s[pos-1] == '/' && pos < s.size()-1 && s[pos+1] == '/'){
-			auto j = s.rfind('/', pos-2);
-			s.erase(j, pos-j+1);
-			continue;
-		}
-		if(s[pos-1] == '/' && pos == s.size()-1){
-			s.erase(s.rfind('/', pos-2));
-			break;
-		}
-		if(pos < s.size()-2 && s[pos-1] == '/' && s[pos+1] == '.' && s[pos+2] == '/'){
-			auto j = s.rfind('/', pos-2);
-			s.erase(j, pos-j+2);
-			continue;
-		}
-		if(pos == s.size()-2 && s[pos-1] == '/' && s[pos+1] == '.'){
-			s.erase(s.rfind('/', pos-2));
-			break;
-		}
-		++pos;
-	}
-	return s;
+	return complete(p).lexically_normal();
 }
 auto is_regular_file(const Path& p) -> bool
 {
-	struct stat st;
-	if(lstat(p.c_str(), &st) != 0){
-		return false;
-	}
-	return S_ISREG(st.st_mode);
+	return is_regular_file(cwd_dir(), p);
 }
 auto is_directory(const Path& p) -> bool
 {
-	struct stat st;
-	if(lstat(p.c_str(), &st) != 0){
-		return false;
-	}
-	return S_ISDIR(st.st_mode);
+	return is_directory(cwd_dir(), p);
+}
+auto is_symlink(const Path& p) -> bool
+{
+	return is_symlink(cwd_dir(), p);
 }
 auto last_write_time(const Path& p) -> std::time_t
 {
-	struct stat st;
-	if(stat(p.c_str(), &st) != 0){
-		throw std::runtime_error("cannot stat "+p.string());
-	}
-	return std::time_t(st.st_mtime);
+	return last_write_time(cwd_dir(), p);
 }
-auto create_directory(const Path& p) -> void
+auto create_directory(const Path& p) -> bool
 {
-#ifndef FS_DRYRUN
-	mkdir(p.c_str(), 0755);
-#else
-	fprintf(stderr, "mkdir %s\n", p.c_str());
-#endif
+	return create_directory(cwd_dir(), p);
 }
-auto current_path() -> Path
+
+auto status(const Path& p, std::error_code& ec) -> file_status
 {
-	char buf[4096];
-	if(!currentdir(buf, 4096)){
-		throw std::runtime_error("cannot retrieve current directory");
-	}
-	return Path(buf);
+	return status(cwd_dir(), p, ec);
 }
-auto current_path(const Path& p) -> void
+auto status(const Path& p, unsigned fields, std::error_code& ec) -> file_status
 {
-	if(chdir(p.c_str()) != 0){
-		throw std::runtime_error("cannot change to directory "+p.string());
-	}
+	return status(cwd_dir(), p, fields, ec);
 }
-
-directory_entry::directory_entry(const Path& p2)
-	: p(p2)
+auto symlink_status(const Path& p, std::error_code& ec) -> file_status
 {
+	return symlink_status(cwd_dir(), p, ec);
 }
-auto directory_entry::path() const -> const Path&
+auto symlink_status(const Path& p, unsigned fields, std::error_code& ec) -> file_status
 {
-	return p;
+	return symlink_status(cwd_dir(), p, fields, ec);
 }
-
-directory_iterator::directory_iterator()
-	: dir(nullptr), dp(nullptr), p()
+auto exists(const Path& p, std::error_code& ec) -> bool
 {
+	return exists(cwd_dir(), p, ec);
 }
-directory_iterator::directory_iterator(const Path& p2)
-	: dir(opendir(p2.string().c_str())), p(p2)
+auto remove(const Path& p, std::error_code& ec) -> bool
 {
-	if(dir == nullptr)
-		throw std::runtime_error("cannot open directory "+p.string());
-	++*this;
+	return remove(cwd_dir(), p, ec);
 }
-directory_iterator::directory_iterator(directory_iterator&& di)
-	: dir(std::move(di.dir)), dp(std::move(di.dp)), p(std::move(di.p))
+auto remove_all(const Path& p, std::error_code& ec) -> bool
 {
-	di.dir = nullptr;
+	return remove_all(cwd_dir(), p, ec);
 }
-directory_iterator::~directory_iterator()
+auto complete(const Path& p, std::error_code& ec) -> Path
 {
-	if(dir != nullptr){
-		closedir(dir);
+	const char *s = p.c_str();
+#ifdef _WIN32
+	if(p.size() >= 3 && isalpha(s[0]) && s[1] == ':' && is_slash(s[2])){
+#else
+	if(p.size() > 0 && is_slash(s[0])){
+#endif
+		ec.clear();
+		return p;
 	}
+	auto cwd = current_path(ec);
+	if(ec || p.empty())
+		return cwd;
+	return cwd / p;
 }
-auto directory_iterator::operator=(directory_iterator&& di) -> directory_iterator&
+auto canonical(const Path& p, std::error_code& ec) -> Path
 {
-	dir = std::move(di.dir);
-	dp = std::move(di.dp);
-	p = std::move(di.p);
-	di.dir = nullptr;
-	return *this;
+	auto r = complete(p, ec);
+	if(ec)
+		return r;
+	return r.lexically_normal();
 }
-auto directory_iterator::operator++() -> directory_iterator&
+auto is_regular_file(const Path& p, std::error_code& ec) -> bool
 {
-	if(dir != nullptr){
-		dp = readdir(dir);
-		if(dp == nullptr){
-			closedir(dir);
-			dir = nullptr;	
-		}
-	}
-	return *this;
+	return is_regular_file(cwd_dir(), p, ec);
 }
-auto directory_iterator::operator*() const -> directory_entry
+auto is_directory(const Path& p, std::error_code& ec) -> bool
 {
-	return directory_entry(p / dp->d_name);
+	return is_directory(cwd_dir(), p, ec);
 }
-auto directory_iterator::operator==(const directory_iterator& rhs) const -> bool
+auto is_symlink(const Path& p, std::error_code& ec) -> bool
 {
-	return dir == rhs.dir && dp == rhs.dp && (p == rhs.p || (dir == nullptr && dp == nullptr));
+	return is_symlink(cwd_dir(), p, ec);
+}
+auto last_write_time(const Path& p, std::error_code& ec) -> std::time_t
+{
+	return last_write_time(cwd_dir(), p, ec);
+}
+auto create_directory(const Path& p, std::error_code& ec) -> bool
+{
+	return create_directory(cwd_dir(), p, ec);
+}
+namespace{
+
+struct cwd_cache{
+	std::mutex m;
+	Path p; // empty while not known
+};
+
+auto cached_cwd() -> cwd_cache&
+{
+	static cwd_cache c;
+	return c;
+}
+
+}
+
+auto current_path() -> Path
+{
+	std::error_code ec;
+	auto r = current_path(ec);
+	if(ec)
+		throw std::system_error(ec, "cannot retrieve current directory");
+	return r;
+}
+auto current_path(const Path& p) -> void
+{
+	std::error_code ec;
+	current_path(p, ec);
+	check(ec, "cannot change to directory ", p);
+}
+auto current_path(std::error_code& ec) -> Path
+{
+	auto& c = cached_cwd();
+	std::lock_guard<std::mutex> lock(c.m);
+	if(c.p.empty()){
+		char buf[4096];
+		if(!currentdir(buf, 4096)){
+			set_error(ec, errno);
+			return Path();
+		}
+		c.p = buf;
+	}
+	ec.clear();
+	return c.p;
+}
+auto current_path(const Path& p, std::error_code& ec) -> void
+{
+	auto& c = cached_cwd();
+	std::lock_guard<std::mutex> lock(c.m);
+	// the new directory is looked up lazily, as p may be relative or
+	// contain symlinks
+	c.p.clear();
+	if(chdir(p.c_str()) != 0)
+		set_error(ec, errno);
+	else
+		ec.clear();
+}
+auto invalidate_current_path_cache() -> void
+{
+	auto& c = cached_cwd();
+	std::lock_guard<std::mutex> lock(c.m);
+	c.p.clear();
+}
+auto equivalent(const Path& p1, const Path& p2) -> bool
+{
+	std::error_code ec;
+	const bool r = equivalent(p1, p2, ec);
+	if(ec)
+		throw std::system_error(ec, std::string("cannot stat ") + p1.c_str() + " or " + p2.c_str());
+	return r;
+}
+// It is an error if neither path exists, or if one could not be stat'ed
+// for a reason other than not existing.
+auto equivalent(const Path& p1, const Path& p2, std::error_code& ec) -> bool
+{
+	std::error_code ec1, ec2;
+	const auto st1 = status(p1, status_ids, ec1);
+	const auto st2 = status(p2, status_ids, ec2);
+	if(st1.type() == status_error){
+		ec = ec1;
+		return false;
+	}
+	if(st2.type() == status_error || (!exists(st1) && !exists(st2))){
+		ec = ec2;
+		return false;
+	}
+	ec.clear();
+	return exists(st1) && exists(st2) && st1.device() == st2.device() && st1.inode() == st2.inode();
+}
+
+namespace{
+
+struct file_id{
+	dev_t dev;
+	ino_t ino;
+
+	auto operator==(const file_id& f) const -> bool
+	{
+		return dev == f.dev && ino == f.ino;
+	}
+};
+
+struct file_id_hash{
+	auto operator()(const file_id& f) const -> size_t
+	{
+		return std::hash<uint64_t>()(uint64_t(f.ino) * 0x9e3779b97f4a7c15ull ^ uint64_t(f.dev));
+	}
+};
+
+}
+
+// Groups paths that refer to the same file. Paths that cannot be stat'ed
+// are left out. Classes are ordered by the first occurrence of one of
+// their members in ps.
+auto equivalence_classes(const std::vector<Path>& ps) -> std::vector<std::vector<Path>>
+{
+	std::vector<std::vector<Path>> classes;
+	std::unordered_map<file_id,size_t,file_id_hash> ids;
+	ids.reserve(ps.size());
+
+	for(const auto& p : ps){
+		struct stat st;
+		if(stat(p.c_str(), &st) != 0)
+			continue;
+		const auto r = ids.insert(std::make_pair(file_id{st.st_dev, st.st_ino}, classes.size()));
+		if(r.second)
+			classes.emplace_back();
+		classes[r.first->second].push_back(p);
+	}
+	return classes;
+}
+
+working_dir::working_dir()
+	: fd(AT_FDCWD)
+{
+}
+working_dir::working_dir(const Path& p)
+	: working_dir(cwd_dir(), p)
+{
+}
+working_dir::working_dir(const working_dir& wd, const Path& p)
+	: fd(-1)
+{
+	std::error_code ec;
+	open(wd, p, ec);
+	check(ec, "cannot open directory ", p);
+}
+working_dir::working_dir(const Path& p, std::error_code& ec)
+	: working_dir(cwd_dir(), p, ec)
+{
+}
+// on failure fd stays invalid, so that relative paths do not silently
+// resolve against the process' working directory instead
+working_dir::working_dir(const working_dir& wd, const Path& p, std::error_code& ec)
+	: fd(-1)
+{
+	open(wd, p, ec);
+}
+auto working_dir::open(const working_dir& wd, const Path& p, std::error_code& ec) -> void
+{
+#ifdef _WIN32
+	(void) wd;
+	(void) p;
+	set_error(ec, ENOSYS);
+#else
+#ifdef O_PATH
+	fd = openat(wd.fd, p.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+	fd = openat(wd.fd, p.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+	if(fd < 0){
+		set_error(ec, errno);
+		return;
+	}
+	owner = std::shared_ptr<const int>(new int(fd), [](const int *p){
+		close(*p);
+		delete p;
+	});
+	ec.clear();
+#endif
+}
+working_dir::working_dir(working_dir&& wd)
+	: fd(wd.fd), owner(std::move(wd.owner))
+{
+	wd.fd = -1;
+}
+working_dir::~working_dir()
+{
+}
+auto working_dir::operator=(working_dir&& wd) -> working_dir&
+{
+	if(this != &wd){
+		fd = wd.fd;
+		owner = std::move(wd.owner);
+		wd.fd = -1;
+	}
+	return *this;
+}
+auto working_dir::native_handle() const -> int
+{
+	return fd;
+}
+
+// Uses statx where the kernel has it and fstatat otherwise. The latter
+// always fills all basic fields, so fields only matters for statx.
+static auto stat_at(int dirfd, const char *p, int flags, unsigned fields, std::error_code& ec) -> file_status
+{
+#ifdef FS_HAVE_STATX
+	static std::atomic<bool> no_statx(false);
+	if(!no_statx.load(std::memory_order_relaxed)){
+		struct statx stx;
+		if(statx(dirfd, p, flags, statx_mask(fields), &stx) == 0){
+			ec.clear();
+			return file_status(stx);
+		}
+		const int err = errno;
+		if(err != ENOSYS){
+			set_error(ec, err);
+			return status_from_error(err);
+		}
+		no_statx.store(true, std::memory_order_relaxed);
+	}
+#else
+	(void) fields;
+#endif
+	struct stat st;
+	if(fstatat(dirfd, p, &st, flags) != 0){
+		const int err = errno;
+		set_error(ec, err);
+		return status_from_error(err);
+	}
+	ec.clear();
+	return file_status(st);
+}
+
+auto status(const working_dir& wd, const Path& p, unsigned fields) -> file_status
+{
+	std::error_code ec;
+	return status(wd, p, fields, ec);
+}
+auto symlink_status(const working_dir& wd, const Path& p, unsigned fields) -> file_status
+{
+	std::error_code ec;
+	return symlink_status(wd, p, fields, ec);
+}
+auto exists(const working_dir& wd, const Path& p) -> bool
+{
+	std::error_code ec;
+	return exists(wd, p, ec);
+}
+auto remove(const working_dir& wd, const Path& p) -> bool
+{
+	std::error_code ec;
+	return remove(wd, p, ec);
+}
+auto remove_all(const working_dir& wd, const Path& p) -> bool
+{
+	std::error_code ec;
+	return remove_all(wd, p, ec);
+}
+auto is_regular_file(const working_dir& wd, const Path& p) -> bool
+{
+	std::error_code ec;
+	return is_regular_file(wd, p, ec);
+}
+auto is_directory(const working_dir& wd, const Path& p) -> bool
+{
+	std::error_code ec;
+	return is_directory(wd, p, ec);
+}
+auto is_symlink(const working_dir& wd, const Path& p) -> bool
+{
+	std::error_code ec;
+	return is_symlink(wd, p, ec);
+}
+auto last_write_time(const working_dir& wd, const Path& p) -> std::time_t
+{
+	std::error_code ec;
+	const auto t = last_write_time(wd, p, ec);
+	check(ec, "cannot stat ", p);
+	return t;
+}
+auto create_directory(const working_dir& wd, const Path& p) -> bool
+{
+	std::error_code ec;
+	const bool r = create_directory(wd, p, ec);
+	check(ec, "cannot create directory ", p);
+	return r;
+}
+
+auto status(const working_dir& wd, const Path& p, std::error_code& ec) -> file_status
+{
+	return stat_at(wd.native_handle(), p.c_str(), 0, status_basic, ec);
+}
+auto status(const working_dir& wd, const Path& p, unsigned fields, std::error_code& ec) -> file_status
+{
+	return stat_at(wd.native_handle(), p.c_str(), 0, fields, ec);
+}
+auto symlink_status(const working_dir& wd, const Path& p, std::error_code& ec) -> file_status
+{
+	return stat_at(wd.native_handle(), p.c_str(), AT_SYMLINK_NOFOLLOW, status_basic, ec);
+}
+auto symlink_status(const working_dir& wd, const Path& p, unsigned fields, std::error_code& ec) -> file_status
+{
+	return stat_at(wd.native_handle(), p.c_str(), AT_SYMLINK_NOFOLLOW, fields, ec);
+}
+// a file that does not exist is not an error here
+auto exists(const working_dir& wd, const Path& p, std::error_code& ec) -> bool
+{
+	const auto st = symlink_status(wd, p, status_type, ec);
+	if(st.type() == file_not_found)
+		ec.clear();
+	return exists(st);
+}
+// removes p without looking up its type again
+static auto remove_known(int dirfd, const char *p, bool dir, std::error_code& ec) -> bool
+{
+#ifndef FS_DRYRUN
+	if(unlinkat(dirfd, p, dir ? AT_REMOVEDIR : 0) != 0){
+		set_error(ec, errno);
+		return false;
+	}
+#else
+	(void) dirfd;
+	fprintf(stderr, "%s %s\n", dir ? "rmdir" : "unlink", p);
+#endif
+	ec.clear();
+	return true;
+}
+// returns false without an error if p does not exist
+auto remove(const working_dir& wd, const Path& p, std::error_code& ec) -> bool
+{
+	const auto st = symlink_status(wd, p, status_type, ec);
+	if(st.type() == file_not_found)
+		ec.clear();
+	if(!exists(st))
+		return false;
+	return remove_known(wd.native_handle(), p.c_str(), is_directory(st), ec);
+}
+auto remove_all(const working_dir& wd, const Path& p, std::error_code& ec) -> bool
+{
+	const auto st = symlink_status(wd, p, status_type, ec);
+	if(st.type() == file_not_found)
+		ec.clear();
+	if(!exists(st))
+		return false;
+	if(!is_directory(st))
+		return remove_known(wd.native_handle(), p.c_str(), false, ec);
+
+	// Depth-first, so at most one directory per level is open at a time.
+	// Everything below p is opened and removed relative to its parent.
+	// dirs[i+1] iterates over the directory of subdirs[i]; dirs[i] stays on
+	// that entry until it is removed, which keeps the parent open for it.
+	std::vector<directory_iterator> dirs;
+	std::vector<directory_entry> subdirs;
+	dirs.push_back(directory_iterator(wd, p, ec));
+	if(ec)
+		return false;
+
+	const auto end_it = directory_iterator();
+
+	while(dirs.size() > 0){
+		auto& dir = dirs.back();
+		bool descend = false;
+
+		// dir must not be used after dirs is modified
+		while(!descend && dir != end_it){
+			const auto e = *dir;
+			const auto name = e.path().filename_view();
+			if(name != "." && name != ".."){
+				if(e.is_directory()){
+					auto sub = e.open_subdir(ec);
+					if(ec)
+						return false;
+					subdirs.push_back(e);
+					dirs.push_back(std::move(sub));
+					descend = true;
+					break;
+				}
+				if(!e.remove(ec))
+					return false;
+			}
+			dir.increment(ec);
+			if(ec)
+				return false;
+		}
+
+		if(!descend){
+			dirs.pop_back();
+			if(subdirs.empty())
+				return remove_known(wd.native_handle(), p.c_str(), true, ec);
+			if(!subdirs.back().remove(ec))
+				return false;
+			subdirs.pop_back();
+			dirs.back().increment(ec);
+			if(ec)
+				return false;
+		}
+	}
+	return true;
+}
+auto is_regular_file(const working_dir& wd, const Path& p, std::error_code& ec) -> bool
+{
+	return is_regular_file(symlink_status(wd, p, status_type, ec));
+}
+auto is_directory(const working_dir& wd, const Path& p, std::error_code& ec) -> bool
+{
+	return is_directory(symlink_status(wd, p, status_type, ec));
+}
+auto is_symlink(const working_dir& wd, const Path& p, std::error_code& ec) -> bool
+{
+	return is_symlink(symlink_status(wd, p, status_type, ec));
+}
+auto last_write_time(const working_dir& wd, const Path& p, std::error_code& ec) -> std::time_t
+{
+	const auto st = status(wd, p, status_mtime, ec);
+	if(ec)
+		return std::time_t(-1);
+	return std::chrono::system_clock::to_time_t(
+		std::chrono::time_point_cast<std::chrono::system_clock::duration>(st.last_write_time()));
+}
+// returns false without an error if p already is a directory
+auto create_directory(const working_dir& wd, const Path& p, std::error_code& ec) -> bool
+{
+#ifndef FS_DRYRUN
+	if(mkdirat(wd.native_handle(), p.c_str(), 0755) != 0){
+		const int err = errno;
+		std::error_code ec2;
+		if(err == EEXIST && is_directory(status(wd, p, status_type, ec2))){
+			ec.clear();
+			return false;
+		}
+		set_error(ec, err);
+		return false;
+	}
+#else
+	fprintf(stderr, "mkdir %s\n", p.c_str());
+#endif
+	ec.clear();
+	return true;
+}
+
+#ifdef FS_HAVE_IO_URING
+namespace{
+
+// Just enough of io_uring to submit requests and reap their completions.
+class uring{
+	int fd;
+	unsigned sq_entries;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_len;
+	size_t cq_ring_len;
+	io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	io_uring_cqe *cqes;
+
+	unsigned tail;
+	unsigned pending;
+
+public:
+	explicit uring(unsigned entries);
+	uring(const uring&) = delete;
+	~uring();
+	auto operator=(const uring&) -> uring& = delete;
+
+	auto ok() const -> bool;
+	auto supports(unsigned op) const -> bool;
+	// nullptr if the submission queue is full
+	auto get_sqe() -> io_uring_sqe*;
+	// submits all prepared requests and waits for at least wait completions
+	auto submit(unsigned wait) -> int;
+	auto reap(io_uring_cqe&) -> bool;
+};
+
+uring::uring(unsigned entries)
+	: fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(nullptr), tail(0), pending(0)
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	fd = int(syscall(__NR_io_uring_setup, entries, &p));
+	if(fd < 0)
+		return;
+
+	sq_entries = p.sq_entries;
+	sq_ring_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cq_ring_len = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+	const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if(single)
+		sq_ring_len = cq_ring_len = std::max(sq_ring_len, cq_ring_len);
+
+	sq_ring = mmap(nullptr, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(sq_ring == MAP_FAILED)
+		return;
+	cq_ring = single ? sq_ring : mmap(nullptr, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if(cq_ring == MAP_FAILED)
+		return;
+	sqes_len = p.sq_entries*sizeof(io_uring_sqe);
+	void *q = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(q == MAP_FAILED)
+		return;
+	sqes = static_cast<io_uring_sqe*>(q);
+
+	char *sq = static_cast<char*>(sq_ring);
+	char *cq = static_cast<char*>(cq_ring);
+	sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+	tail = *sq_tail;
+}
+uring::~uring()
+{
+	if(sqes != nullptr)
+		munmap(sqes, sqes_len);
+	if(cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_len);
+	if(sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_len);
+	if(fd >= 0)
+		close(fd);
+}
+auto uring::ok() const -> bool
+{
+	return sqes != nullptr;
+}
+auto uring::supports(unsigned op) const -> bool
+{
+	constexpr unsigned N = 256;
+	std::vector<char> buf(sizeof(io_uring_probe) + N*sizeof(io_uring_probe_op));
+	auto probe = reinterpret_cast<io_uring_probe*>(buf.data());
+	if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, N) < 0)
+		return false;
+	return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+auto uring::get_sqe() -> io_uring_sqe*
+{
+	const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if(tail - head >= sq_entries)
+		return nullptr;
+	const unsigned i = tail & *sq_mask;
+	sq_array[i] = i;
+	tail++;
+	pending++;
+	memset(&sqes[i], 0, sizeof(io_uring_sqe));
+	return &sqes[i];
+}
+auto uring::submit(unsigned wait) -> int
+{
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+	const int r = int(syscall(__NR_io_uring_enter, fd, pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+	if(r < 0)
+		return -errno;
+	pending -= unsigned(r);
+	return r;
+}
+auto uring::reap(io_uring_cqe& c) -> bool
+{
+	const unsigned head = *cq_head;
+	if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	c = cqes[head & *cq_mask];
+	__atomic_store_n(cq_head, head+1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Keeps up to QD statx requests in flight. Returns false if io_uring or
+// its statx operation is not available, before anything was done. If the
+// ring fails later on, the requests in flight are drained and the paths
+// without a result are looked up synchronously.
+auto status_many_uring(const working_dir& wd, const Path *ps, size_t n, file_status *out, int flags, unsigned fields) -> bool
+{
+	constexpr unsigned QD = 256;
+	uring r(QD);
+	if(!r.ok() || !r.supports(IORING_OP_STATX))
+		return false;
+
+	std::vector<struct statx> bufs(QD);
+	std::vector<size_t> slot_index(QD);
+	std::vector<unsigned> free_slots;
+	free_slots.reserve(QD);
+	for(unsigned i = QD; i > 0; i--)
+		free_slots.push_back(i-1);
+
+	const unsigned mask = statx_mask(fields);
+	size_t next = 0, done = 0;
+	bool failed = false;
+	while(done < n && !failed){
+		while(next < n && !free_slots.empty()){
+			auto sqe = r.get_sqe();
+			if(sqe == nullptr)
+				break;
+			const unsigned slot = free_slots.back();
+			free_slots.pop_back();
+			slot_index[slot] = next;
+
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = wd.native_handle();
+			sqe->addr = uintptr_t(ps[next].c_str());
+			sqe->len = mask;
+			sqe->off = uintptr_t(&bufs[slot]);
+			sqe->statx_flags = flags;
+			sqe->user_data = slot;
+			next++;
+		}
+
+		const int e = r.submit(1);
+		if(e < 0 && e != -EINTR && e != -EAGAIN && e != -EBUSY)
+			failed = true;
+
+		io_uring_cqe c;
+		while(r.reap(c)){
+			const unsigned slot = unsigned(c.user_data);
+			const size_t i = slot_index[slot];
+			out[i] = c.res < 0 ? status_from_error(-c.res) : file_status(bufs[slot]);
+			free_slots.push_back(slot);
+			done++;
+		}
+	}
+	if(!failed)
+		return true;
+
+	// the kernel may still write to bufs of the requests in flight; if
+	// they can't be waited for, bufs is deliberately leaked
+	while(free_slots.size() < QD){
+		const int e = r.submit(1);
+		if(e < 0 && e != -EINTR && e != -EAGAIN && e != -EBUSY){
+			new std::vector<struct statx>(std::move(bufs));
+			break;
+		}
+		io_uring_cqe c;
+		while(r.reap(c)){
+			const unsigned slot = unsigned(c.user_data);
+			out[slot_index[slot]] = c.res < 0 ? status_from_error(-c.res) : file_status(bufs[slot]);
+			free_slots.push_back(slot);
+		}
+	}
+	std::vector<bool> busy(QD, true);
+	for(unsigned slot : free_slots)
+		busy[slot] = false;
+	auto lookup = [&](size_t i){
+		out[i] = (flags & AT_SYMLINK_NOFOLLOW) != 0 ? symlink_status(wd, ps[i], fields) : status(wd, ps[i], fields);
+	};
+	for(unsigned slot = 0; slot < QD; slot++){
+		if(busy[slot])
+			lookup(slot_index[slot]);
+	}
+	for(; next < n; next++)
+		lookup(next);
+	return true;
+}
+
+}
+#endif
+
+auto status_many(const Path *ps, size_t n, file_status *out, unsigned fields) -> void
+{
+	status_many(cwd_dir(), ps, n, out, fields);
+}
+// Small batches are not worth setting up a ring for.
+auto status_many(const working_dir& wd, const Path *ps, size_t n, file_status *out, unsigned fields) -> void
+{
+#ifdef FS_HAVE_IO_URING
+	if(n >= 16 && status_many_uring(wd, ps, n, out, 0, fields))
+		return;
+#endif
+	for(size_t i = 0; i < n; i++)
+		out[i] = status(wd, ps[i], fields);
+}
+auto status_many(const std::vector<Path>& ps, unsigned fields) -> std::vector<file_status>
+{
+	std::vector<file_status> out(ps.size());
+	status_many(ps.data(), ps.size(), out.data(), fields);
+	return out;
+}
+
+auto status_parallel(const Path *ps, size_t n, file_status *out, unsigned threads, unsigned fields) -> void
+{
+	status_parallel(cwd_dir(), ps, n, out, threads, fields);
+}
+// Workers take chunks of paths from a shared counter, so a slow mount
+// point does not hold up one thread's fixed share of the list.
+auto status_parallel(const working_dir& wd, const Path *ps, size_t n, file_status *out, unsigned threads, unsigned fields) -> void
+{
+	constexpr size_t CHUNK = 16;
+	if(threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = unsigned(std::min<size_t>(threads, (n+CHUNK-1)/CHUNK));
+
+	std::atomic<size_t> next(0);
+	auto work = [&](){
+		size_t i;
+		while((i = next.fetch_add(CHUNK)) < n){
+			const size_t e = std::min(i+CHUNK, n);
+			for(; i < e; i++)
+				out[i] = status(wd, ps[i], fields);
+		}
+	};
+
+	// if a thread cannot be started, the ones that were do the work
+	std::vector<std::thread> workers;
+	for(unsigned t = 1; t < threads; t++){
+		try{
+			workers.emplace_back(work);
+		}catch(const std::system_error&){
+			break;
+		}
+	}
+	work();
+	for(auto& w : workers)
+		w.join();
+}
+auto status_parallel(const std::vector<Path>& ps, unsigned threads, unsigned fields) -> std::vector<file_status>
+{
+	std::vector<file_status> out(ps.size());
+	status_parallel(ps.data(), ps.size(), out.data(), threads, fields);
+	return out;
+}
+
+// A path_view is not null-terminated, so it is copied into a Path first.
+// That stays on the stack for all but very long paths.
+auto exists(const path_view& p) -> bool
+{
+	return exists(Path(p));
+}
+auto remove(const path_view& p) -> bool
+{
+	return remove(Path(p));
+}
+auto is_regular_file(const path_view& p) -> bool
+{
+	return is_regular_file(Path(p));
+}
+auto is_directory(const path_view& p) -> bool
+{
+	return is_directory(Path(p));
+}
+auto last_write_time(const path_view& p) -> std::time_t
+{
+	return last_write_time(Path(p));
+}
+
+static auto type_of_dtype(unsigned char d_type) -> file_type
+{
+#ifdef DT_UNKNOWN
+	switch(d_type){
+	case DT_REG: return regular_file;
+	case DT_DIR: return directory_file;
+	case DT_LNK: return symlink_file;
+	case DT_BLK: return block_file;
+	case DT_CHR: return character_file;
+	case DT_FIFO: return fifo_file;
+	case DT_SOCK: return socket_file;
+	}
+#else
+	(void) d_type;
+#endif
+	return type_unknown;
+}
+
+static auto is_dot_or_dotdot(const char *name) -> bool
+{
+	return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// p points to '[' and is moved past the closing ']'. An unterminated
+// class is taken as a literal '['.
+static auto glob_class(const char *& p, char c) -> bool
+{
+	const char *q = p+1;
+	const bool neg = *q == '!' || *q == '^';
+	if(neg)
+		q++;
+	const char *first = q;
+	bool match = false;
+	while(*q != '\0' && (*q != ']' || q == first)){
+		unsigned char lo = *q, hi = *q;
+		if(q[1] == '-' && q[2] != '\0' && q[2] != ']'){
+			hi = q[2];
+			q += 3;
+		}else{
+			q++;
+		}
+		if((unsigned char)c >= lo && (unsigned char)c <= hi)
+			match = true;
+	}
+	if(*q == '\0'){
+		p++;
+		return c == '[';
+	}
+	p = q+1;
+	return match != neg;
+}
+// On a mismatch after a '*', the '*' is retried one character further.
+// Only the most recent '*' needs to be remembered.
+static auto glob_match(const char *p, const char *s) -> bool
+{
+	const char *star_p = nullptr, *star_s = nullptr;
+	while(*s != '\0'){
+		if(*p == '*'){
+			star_p = ++p;
+			star_s = s;
+			continue;
+		}
+		bool ok;
+		if(*p == '?'){
+			ok = true;
+			p++;
+		}else if(*p == '['){
+			ok = glob_class(p, *s);
+		}else{
+			if(*p == '\\' && p[1] != '\0')
+				p++;
+			ok = *p == *s;
+			if(ok)
+				p++;
+		}
+		if(ok){
+			s++;
+			continue;
+		}
+		if(star_p == nullptr)
+			return false;
+		p = star_p;
+		s = ++star_s;
+	}
+	while(*p == '*')
+		p++;
+	return *p == '\0';
+}
+
+name_filter::name_filter()
+{
+}
+name_filter::name_filter(const predicate& f2)
+	: f(f2)
+{
+}
+auto name_filter::extensions(const std::vector<std::string>& exts) -> name_filter
+{
+	return name_filter([exts](const char *name, file_type){
+		const char *e = strrchr(name, '.');
+		const size_t n = e != nullptr ? strlen(e) : 0;
+		for(const auto& x : exts){
+			if(x.size() == n && (n == 0 || memcmp(x.data(), e, n) == 0))
+				return true;
+		}
+		return false;
+	});
+}
+auto name_filter::prefix(const std::string& pre) -> name_filter
+{
+	return name_filter([pre](const char *name, file_type){
+		return strncmp(name, pre.c_str(), pre.size()) == 0;
+	});
+}
+auto name_filter::glob(const std::string& pattern) -> name_filter
+{
+	return name_filter([pattern](const char *name, file_type){
+		return glob_match(pattern.c_str(), name);
+	});
+}
+auto name_filter::operator()(const char *name, file_type t) const -> bool
+{
+	return !is_dot_or_dotdot(name) && (!f || f(name, t));
+}
+
+// An open directory, shared by an iterator and its entries.
+class dir_handle{
+#ifdef FS_HAVE_GETDENTS
+	int fd;
+	bool owned;
+	std::unique_ptr<char[]> buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+#else
+	DIR *dir;
+	int fd;
+#endif
+	dir_handle() = default;
+public:
+	dir_handle(const dir_handle&) = delete;
+	~dir_handle();
+	auto operator=(const dir_handle&) -> dir_handle& = delete;
+
+	static auto open(int fd, const char *name, int flags, size_t buffer_size, std::error_code&) -> std::shared_ptr<dir_handle>;
+	// wraps fd without owning it, so that entries can be resolved relative
+	// to it. Must not be read from.
+	static auto borrow(int fd) -> std::shared_ptr<dir_handle>;
+#ifndef _WIN32
+	// takes ownership of an already open directory fd
+	static auto adopt(int fd, size_t buffer_size, std::error_code&) -> std::shared_ptr<dir_handle>;
+#endif
+	// false at the end of the directory or on error. name stays valid
+	// until the next call.
+	auto read(const char *& name, file_type&, ino_t&, std::error_code&) -> bool;
+	auto native_handle() const -> int;
+	auto buffer_size() const -> size_t;
+};
+
+#ifdef FS_HAVE_GETDENTS
+// glibc only declares this since 2.30
+struct linux_dirent64{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+dir_handle::~dir_handle()
+{
+	if(owned && fd >= 0)
+		close(fd);
+}
+auto dir_handle::open(int fd, const char *name, int flags, size_t buffer_size, std::error_code& ec) -> std::shared_ptr<dir_handle>
+{
+	fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+	if(fd < 0){
+		set_error(ec, errno);
+		return nullptr;
+	}
+	return adopt(fd, buffer_size, ec);
+}
+auto dir_handle::adopt(int fd, size_t buffer_size, std::error_code& ec) -> std::shared_ptr<dir_handle>
+{
+	std::shared_ptr<dir_handle> d(new dir_handle());
+	d->fd = fd;
+	d->owned = true;
+	// must at least hold one entry with a maximum length name
+	d->size = std::max<size_t>(buffer_size, sizeof(linux_dirent64)+256);
+	d->buf.reset(new char[d->size]);
+	d->len = d->pos = 0;
+	ec.clear();
+	return d;
+}
+auto dir_handle::borrow(int fd) -> std::shared_ptr<dir_handle>
+{
+	std::shared_ptr<dir_handle> d(new dir_handle());
+	d->fd = fd;
+	d->owned = false;
+	d->size = directory_iterator::default_buffer_size;
+	d->len = d->pos = 0;
+	return d;
+}
+auto dir_handle::read(const char *& name, file_type& type, ino_t& ino, std::error_code& ec) -> bool
+{
+	ec.clear();
+	if(pos >= len){
+		if(!buf)
+			return false;
+		const long n = syscall(SYS_getdents64, fd, buf.get(), size);
+		if(n <= 0){
+			if(n < 0)
+				set_error(ec, errno);
+			// entries may keep the handle alive for much longer
+			buf.reset();
+			return false;
+		}
+		len = size_t(n);
+		pos = 0;
+	}
+	auto d = reinterpret_cast<const linux_dirent64*>(buf.get()+pos);
+	pos += d->d_reclen;
+	name = d->d_name;
+	type = type_of_dtype(d->d_type);
+	ino = ino_t(d->d_ino);
+	return true;
+}
+auto dir_handle::native_handle() const -> int
+{
+	return fd;
+}
+auto dir_handle::buffer_size() const -> size_t
+{
+	return size;
+}
+#else
+dir_handle::~dir_handle()
+{
+	if(dir != nullptr)
+		closedir(dir);
+}
+auto dir_handle::open(int fd, const char *name, int flags, size_t, std::error_code& ec) -> std::shared_ptr<dir_handle>
+{
+#ifdef _WIN32
+	(void) fd;
+	(void) flags;
+	DIR *d = opendir(name);
+	if(d == nullptr){
+		set_error(ec, errno);
+		return nullptr;
+	}
+	std::shared_ptr<dir_handle> h(new dir_handle());
+	h->dir = d;
+	h->fd = -1;
+	ec.clear();
+	return h;
+#else
+	fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+	if(fd < 0){
+		set_error(ec, errno);
+		return nullptr;
+	}
+	return adopt(fd, 0, ec);
+#endif
+}
+#ifndef _WIN32
+auto dir_handle::adopt(int fd, size_t, std::error_code& ec) -> std::shared_ptr<dir_handle>
+{
+	DIR *d = fdopendir(fd);
+	if(d == nullptr){
+		set_error(ec, errno);
+		close(fd);
+		return nullptr;
+	}
+	std::shared_ptr<dir_handle> h(new dir_handle());
+	h->dir = d;
+	h->fd = -1;
+	ec.clear();
+	return h;
+}
+#endif
+auto dir_handle::borrow(int fd) -> std::shared_ptr<dir_handle>
+{
+	std::shared_ptr<dir_handle> h(new dir_handle());
+	h->dir = nullptr;
+	h->fd = fd;
+	return h;
+}
+auto dir_handle::read(const char *& name, file_type& type, ino_t& ino, std::error_code& ec) -> bool
+{
+	ec.clear();
+	errno = 0;
+	const dirent *dp = readdir(dir);
+	if(dp == nullptr){
+		if(errno != 0)
+			set_error(ec, errno);
+		return false;
+	}
+	name = dp->d_name;
+#ifdef DT_UNKNOWN
+	type = type_of_dtype(dp->d_type);
+#else
+	type = type_unknown;
+#endif
+	ino = dp->d_ino;
+	return true;
+}
+auto dir_handle::native_handle() const -> int
+{
+#ifdef _WIN32
+	return -1;
+#else
+	return dir != nullptr ? dirfd(dir) : fd;
+#endif
+}
+auto dir_handle::buffer_size() const -> size_t
+{
+	return directory_iterator::default_buffer_size;
+}
+#endif
+
+directory_entry::directory_entry(const Path& p2)
+	: directory_entry(nullptr, nullptr, p2, 0, type_unknown, 0)
+{
+}
+directory_entry::directory_entry(const std::shared_ptr<dir_handle>& dir2, const std::shared_ptr<const int>& base2, const Path& p2, size_t name2, file_type t2, ino_t ino2)
+	: p(p2), dir(dir2), base(base2), name(name2), ino(ino2), t(t2), st_valid(false)
+{
+}
+auto directory_entry::locate() const -> location
+{
+	location l{dir.lock(), base ? *base : AT_FDCWD, p.c_str()};
+#ifndef _WIN32
+	if(l.dir){
+		l.fd = l.dir->native_handle();
+		l.name += name;
+	}
+#endif
+	return l;
+}
+auto directory_entry::handle() const -> std::shared_ptr<dir_handle>
+{
+	return dir.lock();
+}
+auto directory_entry::path() const -> const Path&
+{
+	return p;
+}
+auto directory_entry::inode() const -> ino_t
+{
+	if(ino == 0)
+		return symlink_status().inode();
+	return ino;
+}
+auto directory_entry::symlink_status() const -> file_status
+{
+	std::error_code ec;
+	return symlink_status(ec);
+}
+auto directory_entry::symlink_status(std::error_code& ec) const -> file_status
+{
+	if(st_valid){
+		ec.clear();
+		return st;
+	}
+	const auto l = locate();
+	const file_status s = stat_at(l.fd, l.name, AT_SYMLINK_NOFOLLOW, status_basic, ec);
+	if(!ec){
+		st = s;
+		st_valid = true;
+		t = s.type();
+	}
+	return s;
+}
+auto directory_entry::status() const -> file_status
+{
+	std::error_code ec;
+	return status(ec);
+}
+auto directory_entry::status(std::error_code& ec) const -> file_status
+{
+	if(t == type_unknown){
+		const file_status s = symlink_status(ec);
+		if(ec || s.type() != symlink_file)
+			return s;
+	}else if(t != symlink_file){
+		return symlink_status(ec);
+	}
+	const auto l = locate();
+	return stat_at(l.fd, l.name, 0, status_basic, ec);
+}
+auto directory_entry::known_type() const -> file_type
+{
+	if(t == type_unknown)
+		return symlink_status().type();
+	return t;
+}
+auto directory_entry::is_regular_file() const -> bool
+{
+	return known_type() == regular_file;
+}
+auto directory_entry::is_directory() const -> bool
+{
+	return known_type() == directory_file;
+}
+auto directory_entry::is_symlink() const -> bool
+{
+	return known_type() == symlink_file;
+}
+auto directory_entry::remove() const -> bool
+{
+	std::error_code ec;
+	return remove(ec);
+}
+auto directory_entry::remove(std::error_code& ec) const -> bool
+{
+	const bool is_dir = is_directory();
+	const auto l = locate();
+	return remove_known(l.fd, l.name, is_dir, ec);
+}
+auto directory_entry::open_subdir() const -> directory_iterator
+{
+	std::error_code ec;
+	auto it = open_subdir(ec);
+	check(ec, "cannot open directory ", p);
+	return it;
+}
+auto directory_entry::open_subdir(std::error_code& ec) const -> directory_iterator
+{
+	directory_iterator it;
+	it.base = base;
+	it.p = p;
+	const auto l = locate();
+	const size_t size = l.dir ? l.dir->buffer_size() : directory_iterator::default_buffer_size;
+#ifdef O_NOFOLLOW
+	it.open(l.fd, l.name, O_NOFOLLOW, size, ec);
+#else
+	it.open(l.fd, l.name, 0, size, ec);
+#endif
+	return it;
+}
+
+constexpr size_t directory_iterator::default_buffer_size;
+
+directory_iterator::directory_iterator()
+	: dir(), base(), name(nullptr), type(type_unknown), ino(0), p(), filter()
+{
+}
+directory_iterator::directory_iterator(const Path& p2)
+	: directory_iterator(cwd_dir(), p2)
+{
+}
+directory_iterator::directory_iterator(const working_dir& wd, const Path& p2)
+	: directory_iterator(wd, p2, default_buffer_size)
+{
+}
+directory_iterator::directory_iterator(const Path& p2, std::error_code& ec)
+	: directory_iterator(cwd_dir(), p2, ec)
+{
+}
+directory_iterator::directory_iterator(const working_dir& wd, const Path& p2, std::error_code& ec)
+	: directory_iterator(wd, p2, default_buffer_size, ec)
+{
+}
+directory_iterator::directory_iterator(const working_dir& wd, const Path& p2, size_t buffer_size)
+	: directory_iterator()
+{
+	std::error_code ec;
+	base = wd.owner;
+	p = p2;
+	open(wd.native_handle(), p.c_str(), 0, buffer_size, ec);
+	check(ec, "cannot open directory ", p);
+}
+// on failure this is an end iterator
+directory_iterator::directory_iterator(const working_dir& wd, const Path& p2, size_t buffer_size, std::error_code& ec)
+	: directory_iterator()
+{
+	base = wd.owner;
+	p = p2;
+	open(wd.native_handle(), p.c_str(), 0, buffer_size, ec);
+}
+directory_iterator::directory_iterator(const Path& p2, const name_filter& nf)
+	: directory_iterator(cwd_dir(), p2, nf)
+{
+}
+directory_iterator::directory_iterator(const working_dir& wd, const Path& p2, const name_filter& nf)
+	: directory_iterator()
+{
+	std::error_code ec;
+	base = wd.owner;
+	p = p2;
+	filter = nf;
+	open(wd.native_handle(), p.c_str(), 0, default_buffer_size, ec);
+	check(ec, "cannot open directory ", p);
+}
+directory_iterator::directory_iterator(const working_dir& wd, const Path& p2, const name_filter& nf, std::error_code& ec)
+	: directory_iterator()
+{
+	base = wd.owner;
+	p = p2;
+	filter = nf;
+	open(wd.native_handle(), p.c_str(), 0, default_buffer_size, ec);
+}
+auto directory_iterator::open(int fd, const char *name2, int flags, size_t buffer_size, std::error_code& ec) -> void
+{
+	dir = dir_handle::open(fd, name2, flags, buffer_size, ec);
+	if(dir)
+		increment(ec);
+}
+directory_iterator::directory_iterator(directory_iterator&& di)
+	: dir(std::move(di.dir)), base(std::move(di.base)), name(di.name), type(di.type), ino(di.ino), p(std::move(di.p)), filter(std::move(di.filter))
+{
+	di.name = nullptr;
+}
+directory_iterator::~directory_iterator()
+{
+}
+auto directory_iterator::operator=(directory_iterator&& di) -> directory_iterator&
+{
+	dir = std::move(di.dir);
+	base = std::move(di.base);
+	name = di.name;
+	type = di.type;
+	ino = di.ino;
+	p = std::move(di.p);
+	filter = std::move(di.filter);
+	di.name = nullptr;
+	return *this;
+}
+auto directory_iterator::operator++() -> directory_iterator&
+{
+	std::error_code ec;
+	increment(ec);
+	check(ec, "cannot read directory ", p);
+	return *this;
+}
+auto directory_iterator::increment(std::error_code& ec) -> directory_iterator&
+{
+	ec.clear();
+	if(!dir)
+		return *this;
+	bool more;
+	while((more = dir->read(name, type, ino, ec)) && filter && !filter(name, type))
+		;
+	if(!more){
+		name = nullptr;
+		dir.reset();
+	}
+	return *this;
+}
+auto directory_iterator::native_handle() const -> int
+{
+	return dir ? dir->native_handle() : -1;
+}
+
+auto directory_iterator::operator*() const -> directory_entry
+{
+	auto p2 = p / name;
+#ifdef _WIN32
+	const size_t off = 0;
+#else
+	const size_t off = p2.size() - strlen(name);
+#endif
+	return directory_entry(dir, base, p2, off, type, ino);
+}
+auto directory_iterator::operator==(const directory_iterator& rhs) const -> bool
+{
+	return dir == rhs.dir && name == rhs.name && (p == rhs.p || (dir == nullptr && name == nullptr));
 }
 auto directory_iterator::operator!=(const directory_iterator& rhs) const -> bool
 {
 	return ! (*this == rhs);
 }
 
+
+auto read_directory(const Path& p, directory_order order, bool with_status) -> std::vector<directory_entry>
+{
+	return read_directory(cwd_dir(), p, order, with_status);
+}
+auto read_directory(const working_dir& wd, const Path& p, directory_order order, bool with_status) -> std::vector<directory_entry>
+{
+	std::error_code ec;
+	auto v = read_directory(wd, p, order, with_status, ec);
+	check(ec, "cannot read directory ", p);
+	return v;
+}
+// Entries are large, so only (inode, index) pairs are sorted.
+auto read_directory(const working_dir& wd, const Path& p, directory_order order, bool with_status, std::error_code& ec) -> std::vector<directory_entry>
+{
+	std::vector<directory_entry> v;
+	// keeps the directory open until the status pass is done
+	std::shared_ptr<dir_handle> h;
+	for(directory_iterator it(wd, p, name_filter(), ec), end; !ec && it != end; it.increment(ec)){
+		v.push_back(*it);
+		if(!h)
+			h = v.back().handle();
+	}
+	if(ec)
+		return std::vector<directory_entry>();
+
+	if(order == inode_order){
+		std::vector<std::pair<ino_t, size_t>> keys;
+		keys.reserve(v.size());
+		for(size_t i = 0; i < v.size(); i++)
+			keys.emplace_back(v[i].inode(), i);
+		std::sort(keys.begin(), keys.end());
+		std::vector<directory_entry> sorted;
+		sorted.reserve(v.size());
+		for(const auto& k : keys)
+			sorted.push_back(std::move(v[k.second]));
+		v.swap(sorted);
+	}
+	if(with_status){
+		for(const auto& e : v){
+			std::error_code ec2;
+			e.symlink_status(ec2);
+			if(ec2 && !ec)
+				ec = ec2;
+		}
+	}
+	return v;
+}
+
+directory_snapshot::const_iterator::const_iterator(const directory_snapshot *s2, size_t i2)
+	: s(s2), i(i2)
+{
+}
+auto directory_snapshot::const_iterator::operator*() const -> entry
+{
+	return (*s)[i];
+}
+auto directory_snapshot::const_iterator::operator++() -> const_iterator&
+{
+	i++;
+	return *this;
+}
+auto directory_snapshot::const_iterator::operator==(const const_iterator& rhs) const -> bool
+{
+	return s == rhs.s && i == rhs.i;
+}
+auto directory_snapshot::const_iterator::operator!=(const const_iterator& rhs) const -> bool
+{
+	return ! (*this == rhs);
+}
+
+directory_snapshot::directory_snapshot()
+{
+}
+directory_snapshot::directory_snapshot(const Path& p)
+	: directory_snapshot(cwd_dir(), p)
+{
+}
+directory_snapshot::directory_snapshot(const working_dir& wd, const Path& p)
+{
+	std::error_code ec;
+	read(wd, p, ec);
+	check(ec, "cannot read directory ", p);
+}
+directory_snapshot::directory_snapshot(const working_dir& wd, const Path& p, std::error_code& ec)
+{
+	read(wd, p, ec);
+}
+auto directory_snapshot::read(const working_dir& wd, const Path& p, std::error_code& ec) -> void
+{
+	dir = p;
+	names.clear();
+	recs.clear();
+	auto h = dir_handle::open(wd.native_handle(), p.c_str(), 0, directory_iterator::default_buffer_size, ec);
+	if(!h)
+		return;
+
+	const char *name;
+	file_type type;
+	ino_t ino;
+	while(h->read(name, type, ino, ec)){
+		if(is_dot_or_dotdot(name))
+			continue;
+		const size_t n = strlen(name);
+		if(names.size()+n+1 > UINT32_MAX || n > UINT16_MAX){
+			set_error(ec, EOVERFLOW);
+			break;
+		}
+		recs.push_back(record{uint32_t(names.size()), uint16_t(n), uint8_t(type), ino});
+		names.insert(names.end(), name, name+n+1);
+	}
+	if(ec){
+		names.clear();
+		recs.clear();
+	}
+}
+auto directory_snapshot::directory() const -> const Path&
+{
+	return dir;
+}
+auto directory_snapshot::size() const -> size_t
+{
+	return recs.size();
+}
+auto directory_snapshot::empty() const -> bool
+{
+	return recs.empty();
+}
+auto directory_snapshot::operator[](size_t i) const -> entry
+{
+	const auto& r = recs[i];
+	return entry{path_view(names.data()+r.offset, r.length), file_type(r.type), r.ino};
+}
+auto directory_snapshot::path(size_t i) const -> Path
+{
+	return dir / (names.data()+recs[i].offset);
+}
+auto directory_snapshot::begin() const -> const_iterator
+{
+	return const_iterator(this, 0);
+}
+auto directory_snapshot::end() const -> const_iterator
+{
+	return const_iterator(this, recs.size());
+}
+auto directory_snapshot::sort_by_name() -> void
+{
+	const char *base = names.data();
+	std::sort(recs.begin(), recs.end(), [base](const record& a, const record& b){
+		const int c = memcmp(base+a.offset, base+b.offset, std::min(a.length, b.length));
+		return c < 0 || (c == 0 && a.length < b.length);
+	});
+}
+auto directory_snapshot::sort_by_inode() -> void
+{
+	std::sort(recs.begin(), recs.end(), [](const record& a, const record& b){
+		return a.ino < b.ino;
+	});
+}
+
+// Nodes are kept in an unordered_map, whose references stay valid while
+// other nodes are added or removed.
+struct tree_snapshot::scan{
+	tree_snapshot& t;
+	const working_dir& wd;
+	const bool recheck;
+	tree_changes& out;
+	std::error_code err;
+
+	static auto child(const std::string& rel, const std::string& name) -> std::string
+	{
+		return rel.empty() ? name : rel+"/"+name;
+	}
+	auto full(const std::string& rel) const -> Path
+	{
+		return rel.empty() ? t.top : t.top / Path(rel);
+	}
+	// false if rel is gone; other errors leave st as status_error
+	auto stat(const std::string& rel, file_status& st) -> bool
+	{
+		std::error_code ec;
+		// the top directory may be a symlink
+		if(rel.empty())
+			st = status(wd, t.top, status_basic, ec);
+		else
+			st = symlink_status(wd, full(rel), status_basic, ec);
+		if(ec && st.type() != file_not_found && !err)
+			err = ec;
+		return st.type() != file_not_found;
+	}
+	static auto set(node& n, const file_status& st) -> void
+	{
+		n.type = st.type();
+		n.ino = st.inode();
+		n.size = st.size();
+		n.mtime = st.last_write_time();
+	}
+
+	// records rel and everything below it as added
+	auto add(const std::string& rel, const file_status& st) -> void
+	{
+		node& n = t.nodes[rel];
+		set(n, st);
+		n.children.clear();
+		out.added.push_back(full(rel));
+		if(n.type == directory_file)
+			read(rel, n);
+	}
+	// records rel and everything below it as removed
+	auto remove(const std::string& rel) -> void
+	{
+		auto it = t.nodes.find(rel);
+		if(it == t.nodes.end())
+			return;
+		const auto children = std::move(it->second.children);
+		t.nodes.erase(it);
+		out.removed.push_back(full(rel));
+		for(const auto& c : children)
+			remove(child(rel, c));
+	}
+	// lists the directory rel and compares its entries with the old ones
+	auto read(const std::string& rel, node& n) -> void
+	{
+		std::error_code ec;
+		directory_snapshot ds(wd, full(rel), ec);
+		if(ec){
+			if(!err)
+				err = ec;
+			// so it is read again next time
+			n.mtime = file_time();
+			return;
+		}
+		ds.sort_by_name();
+		std::vector<std::string> prev = std::move(n.children);
+		std::sort(prev.begin(), prev.end());
+		n.children.clear();
+		n.children.reserve(ds.size());
+
+		size_t i = 0;
+		for(auto e : ds){
+			const auto name = e.name.string();
+			for(; i < prev.size() && prev[i] < name; i++)
+				remove(child(rel, prev[i]));
+			bool present;
+			if(i < prev.size() && prev[i] == name){
+				i++;
+				present = check(child(rel, name));
+			}else{
+				file_status st;
+				present = stat(child(rel, name), st);
+				if(present)
+					add(child(rel, name), st);
+			}
+			if(present)
+				n.children.push_back(name);
+		}
+		for(; i < prev.size(); i++)
+			remove(child(rel, prev[i]));
+	}
+	// compares rel with what was recorded for it; false if it is gone
+	auto check(const std::string& rel) -> bool
+	{
+		file_status st;
+		if(!stat(rel, st)){
+			remove(rel);
+			return false;
+		}
+		compare(rel, st);
+		return true;
+	}
+	auto compare(const std::string& rel, const file_status& st) -> void
+	{
+		node& n = t.nodes[rel];
+		if(st.type() == status_error)
+			return;
+		if(st.type() != n.type || st.inode() != n.ino){
+			remove(rel);
+			add(rel, st);
+			return;
+		}
+		if(n.type != directory_file){
+			if(st.size() != n.size || st.last_write_time() != n.mtime){
+				set(n, st);
+				out.modified.push_back(full(rel));
+			}
+			return;
+		}
+
+		// a directory modified once the last scan had started may have
+		// changed again within the same timestamp tick
+		const bool same = st.last_write_time() == n.mtime && n.mtime < t.scanned;
+		set(n, st);
+		if(!same){
+			read(rel, n);
+			return;
+		}
+		auto& kids = n.children;
+		size_t k = 0;
+		for(size_t i = 0; i < kids.size(); i++){
+			const auto c = child(rel, kids[i]);
+			const auto it = t.nodes.find(c);
+			bool keep = true;
+			if(it != t.nodes.end() && (it->second.type == directory_file || recheck))
+				keep = check(c);
+			if(keep && k != i)
+				kids[k] = std::move(kids[i]);
+			if(keep)
+				k++;
+		}
+		kids.resize(k);
+	}
+};
+
+tree_snapshot::tree_snapshot()
+{
+}
+tree_snapshot::tree_snapshot(const Path& p)
+	: tree_snapshot(cwd_dir(), p)
+{
+}
+tree_snapshot::tree_snapshot(const working_dir& wd2, const Path& p)
+	: tree_snapshot()
+{
+	std::error_code ec;
+	*this = tree_snapshot(wd2, p, ec);
+	check(ec, "cannot scan ", p);
+}
+tree_snapshot::tree_snapshot(const working_dir& wd2, const Path& p, std::error_code& ec)
+	: top(p)
+{
+	// the process' working directory is followed when it changes
+	if(wd2.native_handle() != AT_FDCWD){
+		wd = working_dir(wd2, Path("."), ec);
+		if(ec)
+			return;
+	}
+	update(wd, false, ec);
+}
+auto tree_snapshot::root() const -> const Path&
+{
+	return top;
+}
+auto tree_snapshot::size() const -> size_t
+{
+	return nodes.size();
+}
+auto tree_snapshot::update(bool recheck_files) -> tree_changes
+{
+	return update(wd, recheck_files);
+}
+auto tree_snapshot::update(const working_dir& wd2, bool recheck_files) -> tree_changes
+{
+	std::error_code ec;
+	auto changes = update(wd2, recheck_files, ec);
+	check(ec, "cannot scan ", top);
+	return changes;
+}
+auto tree_snapshot::update(const working_dir& wd2, bool recheck_files, std::error_code& ec) -> tree_changes
+{
+	// file timestamps lag the clock by up to a tick, and some filesystems
+	// only keep whole or even seconds
+	const auto now = std::chrono::system_clock::now();
+	const file_time start(std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()) - std::chrono::seconds(1));
+
+	tree_changes changes;
+	scan sc{*this, wd2, recheck_files, changes, std::error_code()};
+	file_status st;
+	if(!sc.stat("", st) || st.type() == status_error){
+		if(!sc.err)
+			set_error(sc.err, ENOENT);
+	}else if(nodes.count("") > 0){
+		sc.compare("", st);
+		scanned = start;
+	}else{
+		sc.add("", st);
+		scanned = start;
+	}
+	ec = sc.err;
+	return changes;
+}
+
+struct recursive_directory_iterator::state{
+	struct record{
+		size_t name;
+		file_type type;
+		ino_t ino;
+	};
+	struct level{
+		Path p;
+		directory_iterator it;
+		// once the directory got closed, its remaining entries
+		bool drained;
+		std::vector<char> names;
+		std::vector<record> rest;
+		size_t next;
+	};
+
+	// of the working_dir, for entries of drained levels
+	std::shared_ptr<const int> base;
+	unsigned max_open;
+	unsigned open;
+	std::vector<level> levels;
+	directory_entry cur;
+	bool pending;
+	// directory that caused the last error
+	Path failed;
+
+	state(const std::shared_ptr<const int>& base2, unsigned max_open2)
+		: base(base2), max_open(std::max(max_open2, 1u)), open(0), cur(Path()), pending(true)
+	{
+	}
+
+	auto push(Path&& p, directory_iterator&& it) -> void
+	{
+		levels.emplace_back();
+		auto& l = levels.back();
+		l.p = std::move(p);
+		l.it = std::move(it);
+		l.drained = false;
+		l.next = 0;
+		open++;
+	}
+	auto pop() -> void
+	{
+		if(!levels.back().drained)
+			open--;
+		levels.pop_back();
+	}
+	// moves l to its next entry, or just skips "." and ".." if !step
+	auto settle(level& l, bool step, std::error_code& ec) -> bool
+	{
+		if(l.drained){
+			if(l.next == l.rest.size())
+				return false;
+			const auto& r = l.rest[l.next++];
+			cur = directory_entry(nullptr, base, l.p / &l.names[r.name], 0, r.type, r.ino);
+			return true;
+		}
+		if(step)
+			l.it.increment(ec);
+		while(!ec && l.it.name != nullptr && is_dot_or_dotdot(l.it.name))
+			l.it.increment(ec);
+		if(ec){
+			failed = l.p;
+			return false;
+		}
+		if(l.it.name == nullptr)
+			return false;
+		cur = *l.it;
+		return true;
+	}
+	// reads the rest of l into memory and closes its directory
+	auto drain(level& l, std::error_code& ec) -> void
+	{
+		for(l.it.increment(ec); !ec && l.it.name != nullptr; l.it.increment(ec)){
+			if(is_dot_or_dotdot(l.it.name))
+				continue;
+			l.rest.push_back(record{l.names.size(), l.it.type, l.it.ino});
+			l.names.insert(l.names.end(), l.it.name, l.it.name+strlen(l.it.name)+1);
+		}
+		if(ec)
+			failed = l.p;
+		l.it = directory_iterator();
+		l.drained = true;
+		open--;
+	}
+	// enters cur; false if it could not be opened or is empty
+	auto descend(std::error_code& ec) -> bool
+	{
+		if(open >= max_open){
+			for(auto& l : levels){
+				if(!l.drained){
+					drain(l, ec);
+					break;
+				}
+			}
+			if(ec)
+				return false;
+		}
+		auto it = cur.open_subdir(ec);
+		if(ec){
+			failed = cur.path();
+			return false;
+		}
+		push(Path(cur.path()), std::move(it));
+		if(settle(levels.back(), false, ec))
+			return true;
+		pop();
+		return false;
+	}
+	// moves to the next entry, leaving directories that are done
+	auto advance(std::error_code& ec) -> void
+	{
+		while(!levels.empty()){
+			if(settle(levels.back(), true, ec))
+				return;
+			pop();
+			if(ec)
+				return;
+		}
+	}
+};
+
+constexpr unsigned recursive_directory_iterator::default_max_open;
+
+recursive_directory_iterator::recursive_directory_iterator()
+{
+}
+recursive_directory_iterator::recursive_directory_iterator(const Path& p)
+	: recursive_directory_iterator(cwd_dir(), p)
+{
+}
+recursive_directory_iterator::recursive_directory_iterator(const working_dir& wd, const Path& p, unsigned max_open)
+{
+	std::error_code ec;
+	*this = recursive_directory_iterator(wd, p, max_open, ec);
+	check(ec, "cannot open directory ", p);
+}
+recursive_directory_iterator::recursive_directory_iterator(const Path& p, std::error_code& ec)
+	: recursive_directory_iterator(cwd_dir(), p, ec)
+{
+}
+recursive_directory_iterator::recursive_directory_iterator(const working_dir& wd, const Path& p, std::error_code& ec)
+	: recursive_directory_iterator(wd, p, default_max_open, ec)
+{
+}
+// on failure this is an end iterator
+recursive_directory_iterator::recursive_directory_iterator(const working_dir& wd, const Path& p, unsigned max_open, std::error_code& ec)
+{
+	directory_iterator it(wd, p, ec);
+	if(ec)
+		return;
+	s.reset(new state(wd.owner, max_open));
+	s->push(Path(p), std::move(it));
+	if(!s->settle(s->levels.back(), false, ec))
+		s.reset();
+}
+recursive_directory_iterator::recursive_directory_iterator(recursive_directory_iterator&& rdi)
+	: s(std::move(rdi.s))
+{
+}
+recursive_directory_iterator::~recursive_directory_iterator()
+{
+}
+auto recursive_directory_iterator::operator=(recursive_directory_iterator&& rdi) -> recursive_directory_iterator&
+{
+	s = std::move(rdi.s);
+	return *this;
+}
+auto recursive_directory_iterator::operator++() -> recursive_directory_iterator&
+{
+	std::error_code ec;
+	increment(ec);
+	if(ec)
+		check(ec, "cannot read directory ", s->failed);
+	return *this;
+}
+// on error the iterator stays valid unless there is nothing left to visit.
+// The failed directory is skipped by the next increment.
+auto recursive_directory_iterator::increment(std::error_code& ec) -> recursive_directory_iterator&
+{
+	ec.clear();
+	if(!s || s->levels.empty())
+		return *this;
+	if(s->pending && s->cur.is_directory()){
+		if(s->descend(ec))
+			return *this;
+		if(ec){
+			s->pending = false;
+			return *this;
+		}
+	}
+	s->pending = true;
+	s->advance(ec);
+	if(ec)
+		s->pending = false;
+	else if(s->levels.empty())
+		s.reset();
+	return *this;
+}
+auto recursive_directory_iterator::operator*() const -> const directory_entry&
+{
+	return s->cur;
+}
+auto recursive_directory_iterator::operator==(const recursive_directory_iterator& rhs) const -> bool
+{
+	const bool end = !s || s->levels.empty();
+	const bool rhs_end = !rhs.s || rhs.s->levels.empty();
+	return end || rhs_end ? end == rhs_end : s == rhs.s;
+}
+auto recursive_directory_iterator::operator!=(const recursive_directory_iterator& rhs) const -> bool
+{
+	return ! (*this == rhs);
+}
+auto recursive_directory_iterator::depth() const -> int
+{
+	return int(s->levels.size()) - 1;
+}
+auto recursive_directory_iterator::recursion_pending() const -> bool
+{
+	return s->pending;
+}
+auto recursive_directory_iterator::disable_recursion_pending() -> void
+{
+	s->pending = false;
+}
+auto recursive_directory_iterator::pop() -> void
+{
+	std::error_code ec;
+	pop(ec);
+	if(ec)
+		check(ec, "cannot read directory ", s->failed);
+}
+auto recursive_directory_iterator::pop(std::error_code& ec) -> void
+{
+	ec.clear();
+	if(!s || s->levels.empty())
+		return;
+	s->pop();
+	s->pending = true;
+	s->advance(ec);
+	if(ec)
+		s->pending = false;
+	else if(s->levels.empty())
+		s.reset();
+}
+
+
+// Each worker reads directories from the back of its own deque, and when
+// that is empty takes from the front of another one. pending counts the
+// directories queued or being read; the walk is done when it drops to 0.
+class parallel_walker{
+	// a directory to read, with its parent kept open to open it from
+	struct dir_job{
+		std::shared_ptr<dir_handle> parent;
+		directory_entry e;
+	};
+	struct worker{
+		std::mutex m;
+		std::deque<dir_job> q;
+	};
+
+	const walk_callback& f;
+	const bool with_status;
+	std::vector<std::unique_ptr<worker>> workers;
+	std::atomic<size_t> pending;
+	std::atomic<size_t> queued;
+	std::atomic<unsigned> sleepers;
+	std::atomic<bool> stop;
+	std::mutex idle_m;
+	std::condition_variable idle_cv;
+
+	std::mutex err_m;
+	std::error_code err;
+	std::exception_ptr exc;
+
+	auto fail(const std::error_code& ec) -> void
+	{
+		std::lock_guard<std::mutex> l(err_m);
+		if(!err)
+			err = ec;
+	}
+	auto wake() -> void
+	{
+		if(sleepers > 0){
+			std::lock_guard<std::mutex> l(idle_m);
+			idle_cv.notify_all();
+		}
+	}
+	auto push(unsigned self, const std::shared_ptr<dir_handle>& parent, const directory_entry& e) -> void
+	{
+		pending++;
+		{
+			std::lock_guard<std::mutex> l(workers[self]->m);
+			workers[self]->q.push_back(dir_job{parent, e});
+		}
+		queued++;
+		wake();
+	}
+	auto take(unsigned self, dir_job& j) -> bool
+	{
+		const unsigned n = unsigned(workers.size());
+		for(unsigned k = 0; k < n; k++){
+			auto& w = *workers[(self+k) % n];
+			std::lock_guard<std::mutex> l(w.m);
+			if(w.q.empty())
+				continue;
+			if(k == 0){
+				j = std::move(w.q.back());
+				w.q.pop_back();
+			}else{
+				j = std::move(w.q.front());
+				w.q.pop_front();
+			}
+			queued--;
+			return true;
+		}
+		return false;
+	}
+	auto done() -> void
+	{
+		if(--pending == 0){
+			std::lock_guard<std::mutex> l(idle_m);
+			idle_cv.notify_all();
+		}
+	}
+public:
+	parallel_walker(const walk_callback& f2, bool with_status2, unsigned threads)
+		: f(f2), with_status(with_status2), pending(0), queued(0), sleepers(0), stop(false)
+	{
+		for(unsigned i = 0; i < threads; i++)
+			workers.emplace_back(new worker());
+	}
+
+	auto read(unsigned self, directory_iterator& it, std::error_code& ec) -> void
+	{
+		const directory_iterator end;
+		std::shared_ptr<dir_handle> h;
+		for(; !stop && it != end; it.increment(ec)){
+			auto e = *it;
+			const auto name = e.path().filename_view();
+			if(name == "." || name == "..")
+				continue;
+			if(!h)
+				h = e.handle();
+			if(with_status)
+				e.symlink_status();
+			try{
+				f(e);
+			}catch(...){
+				std::lock_guard<std::mutex> l(err_m);
+				if(!exc)
+					exc = std::current_exception();
+				stop = true;
+				wake();
+				return;
+			}
+			if(e.is_directory())
+				push(self, h, e);
+		}
+		if(ec)
+			fail(ec);
+	}
+	auto run(unsigned self) -> void
+	{
+		dir_job j{nullptr, directory_entry(Path())};
+		for(;;){
+			if(!take(self, j)){
+				std::unique_lock<std::mutex> l(idle_m);
+				sleepers++;
+				idle_cv.wait(l, [&](){ return pending == 0 || queued > 0 || stop; });
+				sleepers--;
+				if(pending == 0 || stop)
+					return;
+				continue;
+			}
+			std::error_code ec;
+			auto it = j.e.open_subdir(ec);
+			j.parent.reset();
+			if(ec)
+				fail(ec);
+			else
+				read(self, it, ec);
+			done();
+		}
+	}
+	auto finish(std::error_code& ec) -> void
+	{
+		if(exc)
+			std::rethrow_exception(exc);
+		ec = err;
+	}
+};
+
+auto walk_parallel(const Path& p, const walk_callback& f, unsigned threads, bool with_status) -> void
+{
+	walk_parallel(cwd_dir(), p, f, threads, with_status);
+}
+auto walk_parallel(const working_dir& wd, const Path& p, const walk_callback& f, unsigned threads, bool with_status) -> void
+{
+	std::error_code ec;
+	walk_parallel(wd, p, f, threads, with_status, ec);
+	check(ec, "cannot walk ", p);
+}
+// The top directory is read by the calling thread, which then becomes
+// worker 0. Queued directories keep their parent open, so they are
+// opened relative to it.
+auto walk_parallel(const working_dir& wd, const Path& p, const walk_callback& f, unsigned threads, bool with_status, std::error_code& ec) -> void
+{
+	if(threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	directory_iterator it(wd, p, ec);
+	if(ec)
+		return;
+	parallel_walker w(f, with_status, threads);
+	w.read(0, it, ec);
+	it = directory_iterator();
+
+	// workers that cannot be started leave their share to the others
+	std::vector<std::thread> ts;
+	for(unsigned t = 1; t < threads; t++){
+		try{
+			ts.emplace_back([&w, t](){ w.run(t); });
+		}catch(const std::system_error&){
+			break;
+		}
+	}
+	w.run(0);
+	for(auto& t : ts)
+		t.join();
+	w.finish(ec);
+}
+
+
+// Directories are listed by the workers in the order the caller will
+// visit them: a job's key is the path of indices from the top directory,
+// so the smallest key is always the next one needed. Children are queued
+// as soon as their parent has been read. Jobs that are still queued when
+// the caller reaches them are read by the caller itself, so a read-ahead
+// window filled by later directories cannot stall the walk. A job keeps
+// its parent directory open to open its own from, and once listed, its
+// own directory for its entries.
+class ordered_walker{
+	enum job_state{ job_queued, job_running, job_done };
+	struct job{
+		std::vector<uint32_t> key;
+		std::shared_ptr<dir_handle> parent;
+		directory_entry dir;
+		std::shared_ptr<dir_handle> handle;
+		job_state state;
+		std::vector<directory_entry> entries;
+		std::vector<std::shared_ptr<job>> subdirs;
+		std::error_code ec;
+
+		job() : dir(Path()), state(job_queued) {}
+	};
+	typedef std::shared_ptr<job> job_ptr;
+	struct later{
+		auto operator()(const job_ptr& a, const job_ptr& b) const -> bool
+		{
+			return a->key > b->key;
+		}
+	};
+
+	const working_dir& wd;
+	const Path& top;
+	const walk_callback& f;
+	const bool with_status;
+	const size_t read_ahead;
+
+	std::mutex m;
+	std::condition_variable work_cv;
+	std::condition_variable done_cv;
+	std::priority_queue<job_ptr, std::vector<job_ptr>, later> queue;
+	// jobs taken by a worker that the caller has not started on yet
+	size_t ahead;
+	bool stop;
+	std::vector<std::thread> workers;
+
+	static auto by_name(const path_view& x, const path_view& y) -> bool
+	{
+		const int c = memcmp(x.data(), y.data(), std::min(x.size(), y.size()));
+		return c < 0 || (c == 0 && x.size() < y.size());
+	}
+	// reads and sorts j's directory, then queues its subdirectories
+	auto list(job& j) -> void
+	{
+		auto it = j.key.empty() ? directory_iterator(wd, top, j.ec) : j.dir.open_subdir(j.ec);
+		j.parent.reset();
+		std::vector<directory_entry> unsorted;
+		for(const directory_iterator end; !j.ec && it != end; it.increment(j.ec)){
+			auto e = *it;
+			const auto name = e.path().filename_view();
+			if(name == "." || name == "..")
+				continue;
+			if(!j.handle)
+				j.handle = e.handle();
+			unsorted.push_back(std::move(e));
+		}
+		// entries are large, so only their names are sorted
+		std::vector<std::pair<path_view, size_t>> order;
+		order.reserve(unsorted.size());
+		for(size_t i = 0; i < unsorted.size(); i++)
+			order.emplace_back(unsorted[i].path().filename_view(), i);
+		std::sort(order.begin(), order.end(), [](const std::pair<path_view, size_t>& a, const std::pair<path_view, size_t>& b){
+			return by_name(a.first, b.first);
+		});
+		j.entries.reserve(unsorted.size());
+		for(const auto& o : order)
+			j.entries.push_back(std::move(unsorted[o.second]));
+		j.subdirs.resize(j.entries.size());
+		for(size_t i = 0; i < j.entries.size(); i++){
+			auto& e = j.entries[i];
+			if(with_status)
+				e.symlink_status();
+			if(!e.is_directory())
+				continue;
+			job_ptr sub(new job());
+			sub->key = j.key;
+			sub->key.push_back(uint32_t(i));
+			sub->parent = j.handle;
+			sub->dir = e;
+			j.subdirs[i] = sub;
+		}
+
+		std::lock_guard<std::mutex> l(m);
+		for(auto& sub : j.subdirs){
+			if(sub)
+				queue.push(sub);
+		}
+		j.state = job_done;
+		done_cv.notify_all();
+		work_cv.notify_all();
+	}
+	auto run() -> void
+	{
+		std::unique_lock<std::mutex> l(m);
+		for(;;){
+			work_cv.wait(l, [&](){ return stop || (!queue.empty() && ahead < read_ahead); });
+			if(stop)
+				return;
+			auto j = queue.top();
+			queue.pop();
+			if(j->state != job_queued)
+				continue;
+			j->state = job_running;
+			ahead++;
+			l.unlock();
+			list(*j);
+			l.lock();
+		}
+	}
+	// waits for j to be listed, or lists it right away if nobody started
+	auto get(job& j) -> void
+	{
+		std::unique_lock<std::mutex> l(m);
+		if(j.state == job_queued){
+			j.state = job_running;
+			l.unlock();
+			list(j);
+			return;
+		}
+		done_cv.wait(l, [&](){ return j.state == job_done; });
+		ahead--;
+		work_cv.notify_one();
+	}
+public:
+	ordered_walker(const working_dir& wd2, const Path& top2, const walk_callback& f2, bool with_status2, size_t read_ahead2)
+		: wd(wd2), top(top2), f(f2), with_status(with_status2), read_ahead(std::max<size_t>(read_ahead2, 1)), ahead(0), stop(false)
+	{
+	}
+	~ordered_walker()
+	{
+		{
+			std::lock_guard<std::mutex> l(m);
+			stop = true;
+			work_cv.notify_all();
+		}
+		for(auto& w : workers)
+			w.join();
+	}
+
+	auto walk(unsigned threads, std::error_code& ec) -> void
+	{
+		for(unsigned t = 0; t < threads; t++)
+			workers.emplace_back([this](){ run(); });
+
+		struct frame{
+			job_ptr j;
+			size_t i;
+		};
+		std::vector<frame> stack;
+		job_ptr root(new job());
+		root->state = job_running;
+		list(*root);
+		ec = root->ec;
+		stack.push_back(frame{root, 0});
+		while(!stack.empty()){
+			auto& fr = stack.back();
+			if(fr.i == fr.j->entries.size()){
+				stack.pop_back();
+				continue;
+			}
+			const size_t i = fr.i++;
+			f(fr.j->entries[i]);
+			job_ptr sub = fr.j->subdirs[i];
+			if(!sub)
+				continue;
+			// the caller no longer needs these
+			fr.j->entries[i] = directory_entry(Path());
+			fr.j->subdirs[i].reset();
+			// what was read before an error is still walked, so the
+			// subdirectories queued from it are all taken
+			get(*sub);
+			if(sub->ec && !ec)
+				ec = sub->ec;
+			stack.push_back(frame{std::move(sub), 0});
+		}
+	}
+};
+
+auto walk_parallel_ordered(const Path& p, const walk_callback& f, unsigned threads, bool with_status, size_t read_ahead) -> void
+{
+	walk_parallel_ordered(cwd_dir(), p, f, threads, with_status, read_ahead);
+}
+auto walk_parallel_ordered(const working_dir& wd, const Path& p, const walk_callback& f, unsigned threads, bool with_status, size_t read_ahead) -> void
+{
+	std::error_code ec;
+	walk_parallel_ordered(wd, p, f, threads, with_status, read_ahead, ec);
+	check(ec, "cannot walk ", p);
+}
+auto walk_parallel_ordered(const working_dir& wd, const Path& p, const walk_callback& f, unsigned threads, bool with_status, size_t read_ahead, std::error_code& ec) -> void
+{
+	if(threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	ec.clear();
+	ordered_walker w(wd, p, f, with_status, read_ahead);
+	w.walk(threads, ec);
+}
+
+
+#ifdef FS_HAVE_IO_URING
+// Opens and stats are submitted to io_uring, up to QD at a time, and a
+// directory is read with getdents64 as soon as its open completes. Stats
+// go before opens, so that directories are not opened faster than their
+// entries are handed out. Directories waiting to be opened are taken last
+// in, first out; that keeps the walk roughly depth-first and the number of
+// parent handles held by them small. The directories held open are counted
+// and kept below half the descriptor limit; if opens cannot go on because
+// only waiting directories hold the handles, those are opened by path.
+class async_walker{
+	static constexpr unsigned QD = 256;
+	struct dir_job{
+		std::shared_ptr<dir_handle> parent;
+		Path p;
+		// offset of the name to open relative to parent
+		size_t name;
+		int flags;
+	};
+	// entries only refer to their directory weakly
+	struct stat_job{
+		std::shared_ptr<dir_handle> dir;
+		directory_entry e;
+	};
+	struct slot{
+		bool is_open;
+		dir_job job;
+		stat_job st;
+		struct statx stx;
+
+		slot() : st{nullptr, directory_entry(Path())} {}
+	};
+	// closes the directory and counts it as no longer held
+	struct release{
+		async_walker *w;
+		std::shared_ptr<dir_handle> h;
+
+		auto operator()(dir_handle*) -> void
+		{
+			h.reset();
+			w->held--;
+		}
+	};
+
+	uring r;
+	const walk_callback& f;
+	const bool with_status;
+	// directories open or being opened; declared before everything that
+	// can hold them
+	unsigned held;
+	unsigned limit;
+	std::shared_ptr<dir_handle> root;
+	std::vector<slot> slots;
+	std::vector<unsigned> free_slots;
+	std::vector<dir_job> dirs;
+	std::deque<stat_job> stats;
+	unsigned inflight;
+	std::shared_ptr<const int> base;
+	std::error_code err;
+
+	auto fail(const std::error_code& ec) -> void
+	{
+		if(!err)
+			err = ec;
+	}
+	auto deliver(const std::shared_ptr<dir_handle>& h, const directory_entry& e) -> void
+	{
+		f(e);
+		if(e.is_directory())
+			dirs.push_back(dir_job{h, e.p, e.name, O_NOFOLLOW});
+	}
+	auto opened(const dir_job& j, int fd) -> void
+	{
+		std::error_code ec;
+		auto d = dir_handle::adopt(fd, directory_iterator::default_buffer_size, ec);
+		if(!d){
+			held--;
+			fail(ec);
+			return;
+		}
+		std::shared_ptr<dir_handle> h(d.get(), release{this, d});
+		d.reset();
+		const char *name;
+		file_type type;
+		ino_t ino;
+		while(h->read(name, type, ino, ec)){
+			if(is_dot_or_dotdot(name))
+				continue;
+			auto p2 = j.p / name;
+			const size_t off = p2.size() - strlen(name);
+			directory_entry e(h, base, p2, off, type, ino);
+			if(with_status || type == type_unknown)
+				stats.push_back(stat_job{h, std::move(e)});
+			else
+				deliver(h, e);
+		}
+		if(ec)
+			fail(ec);
+	}
+	auto complete(slot& s, int res) -> void
+	{
+		if(s.is_open){
+			auto j = std::move(s.job);
+			s.job = dir_job();
+			if(res >= 0){
+				opened(j, res);
+				return;
+			}
+			held--;
+			if((res == -EMFILE || res == -ENFILE) && held > 0){
+				// try again once fewer directories are open
+				limit = held;
+				dirs.push_back(std::move(j));
+				return;
+			}
+			fail(std::error_code(-res, std::generic_category()));
+			return;
+		}
+		auto j = std::move(s.st);
+		s.st = stat_job{nullptr, directory_entry(Path())};
+		if(res >= 0){
+			j.e.st = file_status(s.stx);
+			j.e.st_valid = true;
+			j.e.t = j.e.st.type();
+		}
+		deliver(j.dir, j.e);
+	}
+	// the handles are held only by directories waiting to be opened
+	auto unpin() -> void
+	{
+		for(auto& j : dirs){
+			j.parent = root;
+			j.name = 0;
+		}
+		if(held >= limit)
+			limit = held+1;
+	}
+	// a stat if there is one, otherwise an open
+	auto take(slot& s) -> void
+	{
+		if(!stats.empty()){
+			s.is_open = false;
+			s.st = std::move(stats.front());
+			stats.pop_front();
+		}else{
+			s.is_open = true;
+			s.job = std::move(dirs.back());
+			dirs.pop_back();
+			held++;
+		}
+	}
+	auto prepare(io_uring_sqe *sqe) -> void
+	{
+		const unsigned i = free_slots.back();
+		free_slots.pop_back();
+		auto& s = slots[i];
+		take(s);
+		if(!s.is_open){
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = s.st.dir->native_handle();
+			sqe->addr = uintptr_t(s.st.e.p.c_str() + s.st.e.name);
+			sqe->len = statx_mask(status_basic);
+			sqe->off = uintptr_t(&s.stx);
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		}else{
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = s.job.parent->native_handle();
+			sqe->addr = uintptr_t(s.job.p.c_str() + s.job.name);
+			sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | s.job.flags;
+		}
+		sqe->user_data = i;
+		inflight++;
+	}
+	// waits for the requests in flight, completing them or just closing
+	// what they opened; if the ring fails meanwhile, the kernel may still
+	// write to the slots, so they are deliberately leaked
+	auto drain(bool process) -> int
+	{
+		while(inflight > 0){
+			const int e = r.submit(1);
+			if(e < 0 && e != -EINTR && e != -EAGAIN && e != -EBUSY){
+				new std::vector<slot>(std::move(slots));
+				inflight = 0;
+				return e;
+			}
+			io_uring_cqe c;
+			while(r.reap(c)){
+				const unsigned i = unsigned(c.user_data);
+				inflight--;
+				if(process){
+					free_slots.push_back(i);
+					complete(slots[i], c.res);
+				}else if(slots[i].is_open && c.res >= 0){
+					close(c.res);
+				}
+			}
+		}
+		return 0;
+	}
+	// the rest of the walk without the ring
+	auto walk_sync() -> void
+	{
+		slot s;
+		while(!dirs.empty() || !stats.empty()){
+			if(stats.empty() && held >= limit)
+				unpin();
+			take(s);
+			int res;
+			if(s.is_open)
+				res = openat(s.job.parent->native_handle(), s.job.p.c_str() + s.job.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | s.job.flags);
+			else
+				res = statx(s.st.dir->native_handle(), s.st.e.p.c_str() + s.st.e.name, AT_SYMLINK_NOFOLLOW, statx_mask(status_basic), &s.stx);
+			complete(s, res < 0 ? -errno : res);
+		}
+	}
+public:
+	async_walker(const walk_callback& f2, bool with_status2)
+		: r(QD), f(f2), with_status(with_status2), held(0), limit(QD), slots(QD), inflight(0)
+	{
+		for(unsigned i = QD; i > 0; i--)
+			free_slots.push_back(i-1);
+		rlimit rl;
+		if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+			limit = unsigned(std::max<rlim_t>(1, std::min<rlim_t>(QD, rl.rlim_cur/2)));
+	}
+	// the kernel may still write to the slots of requests in flight
+	~async_walker()
+	{
+		drain(false);
+	}
+	auto ok() const -> bool
+	{
+		return r.ok() && r.supports(IORING_OP_OPENAT) && r.supports(IORING_OP_STATX);
+	}
+	auto walk(const working_dir& wd, const Path& p, std::error_code& ec) -> void
+	{
+		base = wd.owner;
+		root = dir_handle::borrow(wd.native_handle());
+		dirs.push_back(dir_job{root, p, 0, 0});
+		while(!dirs.empty() || !stats.empty() || inflight > 0){
+			while(!free_slots.empty() && (!stats.empty() || (!dirs.empty() && held < limit))){
+				auto sqe = r.get_sqe();
+				if(sqe == nullptr)
+					break;
+				prepare(sqe);
+			}
+			if(inflight == 0 && stats.empty() && !dirs.empty()){
+				unpin();
+				continue;
+			}
+
+			const int e = r.submit(1);
+			if(e < 0 && e != -EINTR && e != -EAGAIN && e != -EBUSY){
+				// finish what the ring took, then go on without it; only
+				// requests lost with it are an error
+				const int e2 = drain(true);
+				if(e2 < 0)
+					fail(std::error_code(-e2, std::generic_category()));
+				walk_sync();
+				break;
+			}
+
+			io_uring_cqe c;
+			while(r.reap(c)){
+				const unsigned i = unsigned(c.user_data);
+				inflight--;
+				free_slots.push_back(i);
+				complete(slots[i], c.res);
+			}
+		}
+		ec = err;
+	}
+};
+#endif
+
+auto walk_async(const Path& p, const walk_callback& f, bool with_status) -> void
+{
+	walk_async(cwd_dir(), p, f, with_status);
+}
+auto walk_async(const working_dir& wd, const Path& p, const walk_callback& f, bool with_status) -> void
+{
+	std::error_code ec;
+	walk_async(wd, p, f, with_status, ec);
+	check(ec, "cannot walk ", p);
+}
+auto walk_async(const working_dir& wd, const Path& p, const walk_callback& f, bool with_status, std::error_code& ec) -> void
+{
+	ec.clear();
+#ifdef FS_HAVE_IO_URING
+	async_walker w(f, with_status);
+	if(w.ok()){
+		w.walk(wd, p, ec);
+		return;
+	}
+#endif
+	walk_parallel(wd, p, f, 1, with_status, ec);
+}
+
+
+#ifdef __linux__
+// Watched directories are known by their path relative to the root, which
+// is "". A directory that is moved away loses its watches; if it reappears
+// inside the tree, it is watched again like a new one.
+struct watcher::impl{
+	static constexpr uint32_t MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+		| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+	typedef std::chrono::steady_clock clock;
+
+	// opened again, so the caller's working_dir may go away
+	working_dir wd;
+	const Path root;
+	// length of root plus separator in paths built from it
+	const size_t prefix_len;
+	const clock::duration debounce;
+	int fd;
+	int wake;
+	std::atomic<bool> stopping;
+	std::error_code err;
+
+	std::unordered_map<int, std::string> by_wd;
+	std::map<std::string, int> by_path;
+
+	std::vector<watch_event> batch;
+	std::unordered_map<std::string, size_t> index;
+	clock::time_point first, last;
+
+	impl(const Path& root2, std::chrono::milliseconds debounce2)
+		: root(root2), prefix_len((root2 / Path("x")).size() - 1), debounce(debounce2), fd(-1), wake(-1), stopping(false)
+	{
+	}
+	~impl()
+	{
+		if(fd >= 0)
+			close(fd);
+		if(wake >= 0)
+			close(wake);
+	}
+
+	static auto child(const std::string& rel, const char *name) -> std::string
+	{
+		return rel.empty() ? std::string(name) : rel+"/"+name;
+	}
+	auto full(const std::string& rel) const -> Path
+	{
+		return rel.empty() ? root : root / Path(rel);
+	}
+	auto note(const std::string& rel, unsigned flags) -> void
+	{
+		const auto now = clock::now();
+		if(batch.empty())
+			first = now;
+		last = now;
+		auto it = index.find(rel);
+		if(it != index.end()){
+			batch[it->second].flags |= flags;
+			return;
+		}
+		index.emplace(rel, batch.size());
+		batch.push_back(watch_event{full(rel), flags});
+	}
+	auto fail(const std::string& rel, int e) -> void
+	{
+		// it is gone, its parent reports that
+		if(e == ENOENT || e == ENOTDIR)
+			return;
+		note(rel, watch_rescan);
+		if(!err)
+			set_error(err, e);
+	}
+	// inotify only takes paths, so the working_dir is reached through /proc
+	auto add_watch(const std::string& rel) -> bool
+	{
+		auto p = full(rel);
+		std::string s = p.string();
+		if(wd.native_handle() != AT_FDCWD && s[0] != '/')
+			s = "/proc/self/fd/" + std::to_string(wd.native_handle()) + "/" + s;
+		const int w = inotify_add_watch(fd, s.c_str(), MASK | (rel.empty() ? 0 : IN_DONT_FOLLOW));
+		if(w < 0){
+			const int e = errno;
+			fail(rel, e);
+			errno = e;
+			return false;
+		}
+		by_wd[w] = rel;
+		by_path[rel] = w;
+		return true;
+	}
+	// watches rel and the directories below it
+	auto add_tree(const std::string& rel, bool report) -> void
+	{
+		if(!add_watch(rel))
+			return;
+		std::error_code ec;
+		recursive_directory_iterator it(wd, full(rel), ec);
+		if(ec)
+			fail(rel, ec.value());
+		for(const recursive_directory_iterator end; it != end; it.increment(ec)){
+			if(ec){
+				fail(rel, ec.value());
+				continue;
+			}
+			const auto& e = *it;
+			const auto& p = e.path();
+			const std::string crel(p.c_str() + prefix_len, p.size() - prefix_len);
+			if(report)
+				note(crel, watch_created);
+			if(e.is_directory())
+				add_watch(crel);
+		}
+	}
+	// forgets the watches on rel and below it
+	auto drop_tree(const std::string& rel) -> void
+	{
+		auto it = by_path.lower_bound(rel);
+		while(it != by_path.end() && it->first.compare(0, rel.size(), rel) == 0){
+			if(it->first.size() > rel.size() && it->first[rel.size()] != '/'){
+				++it;
+				continue;
+			}
+			inotify_rm_watch(fd, it->second);
+			by_wd.erase(it->second);
+			it = by_path.erase(it);
+		}
+	}
+	auto overflow() -> void
+	{
+		note("", watch_rescan);
+		for(const auto& w : by_wd)
+			inotify_rm_watch(fd, w.first);
+		by_wd.clear();
+		by_path.clear();
+		add_tree("", false);
+	}
+	auto open(const working_dir& wd2, std::error_code& ec) -> void
+	{
+		// the process' working directory is followed when it changes
+		if(wd2.native_handle() != AT_FDCWD){
+			wd = working_dir(wd2, Path("."), ec);
+			if(ec)
+				return;
+		}
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(fd < 0 || wake < 0){
+			set_error(ec, errno);
+			return;
+		}
+		add_tree("", false);
+		if(by_path.empty()){
+			set_error(ec, errno);
+			return;
+		}
+		batch.clear();
+		index.clear();
+		ec = err;
+		err.clear();
+	}
+	auto read(std::error_code& ec) -> void
+	{
+		alignas(inotify_event) char buf[65536];
+		for(;;){
+			const ssize_t n = ::read(fd, buf, sizeof(buf));
+			if(n < 0){
+				if(errno == EINTR)
+					continue;
+				if(errno != EAGAIN)
+					set_error(err, errno);
+				break;
+			}
+			for(ssize_t i = 0; i < n; ){
+				const auto ev = reinterpret_cast<const inotify_event*>(buf+i);
+				handle(*ev);
+				i += sizeof(inotify_event) + ev->len;
+			}
+		}
+		ec = err;
+		err.clear();
+	}
+	auto timeout() const -> int
+	{
+		if(batch.empty())
+			return -1;
+		const auto due = std::min(last + debounce, first + 10*debounce);
+		const auto left = due - clock::now();
+		if(left <= clock::duration::zero())
+			return 0;
+		return int(std::chrono::duration_cast<std::chrono::milliseconds>(left + std::chrono::milliseconds(1) - clock::duration(1)).count());
+	}
+	auto handle(const inotify_event& ev) -> void
+	{
+		if(ev.mask & IN_Q_OVERFLOW){
+			overflow();
+			return;
+		}
+		auto w = by_wd.find(ev.wd);
+		if(w == by_wd.end())
+			return;
+		const std::string rel = w->second;
+		if(ev.mask & IN_IGNORED){
+			auto p = by_path.find(rel);
+			if(p != by_path.end() && p->second == ev.wd)
+				by_path.erase(p);
+			by_wd.erase(w);
+			return;
+		}
+		// events on a watched directory itself are reported by its parent
+		if(ev.len == 0){
+			if(rel.empty() && (ev.mask & IN_DELETE_SELF))
+				note(rel, watch_removed);
+			return;
+		}
+
+		const auto crel = child(rel, ev.name);
+		if(ev.mask & (IN_DELETE | IN_MOVED_FROM)){
+			note(crel, watch_removed);
+			if(ev.mask & IN_ISDIR)
+				drop_tree(crel);
+		}
+		if(ev.mask & (IN_CREATE | IN_MOVED_TO)){
+			note(crel, watch_created);
+			if(ev.mask & IN_ISDIR)
+				add_tree(crel, true);
+		}
+		if(ev.mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE))
+			note(crel, watch_modified);
+	}
+};
+
+constexpr uint32_t watcher::impl::MASK;
+
+watcher::watcher(const Path& p, std::chrono::milliseconds debounce)
+	: watcher(cwd_dir(), p, debounce)
+{
+}
+watcher::watcher(const working_dir& wd, const Path& p, std::chrono::milliseconds debounce)
+	: d(new impl(p, debounce))
+{
+	std::error_code ec;
+	d->open(wd, ec);
+	check(ec, "cannot watch ", p);
+}
+watcher::watcher(const working_dir& wd, const Path& p, std::chrono::milliseconds debounce, std::error_code& ec)
+	: d(new impl(p, debounce))
+{
+	d->open(wd, ec);
+	if(ec && d->fd >= 0){
+		close(d->fd);
+		d->fd = -1;
+	}
+}
+watcher::~watcher()
+{
+}
+auto watcher::native_handle() const -> int
+{
+	return d->fd;
+}
+auto watcher::process() -> void
+{
+	std::error_code ec;
+	process(ec);
+	check(ec, "cannot watch ", d->root);
+}
+auto watcher::process(std::error_code& ec) -> void
+{
+	ec.clear();
+	if(d->fd >= 0)
+		d->read(ec);
+}
+auto watcher::timeout() const -> int
+{
+	return d->timeout();
+}
+auto watcher::take(std::vector<watch_event>& out) -> bool
+{
+	if(d->timeout() != 0)
+		return false;
+	out.clear();
+	out.swap(d->batch);
+	d->index.clear();
+	return true;
+}
+auto watcher::run(const callback& f) -> void
+{
+	std::vector<watch_event> b;
+	while(!d->stopping && d->fd >= 0){
+		pollfd p[2] = {{d->fd, POLLIN, 0}, {d->wake, POLLIN, 0}};
+		if(poll(p, 2, timeout()) < 0 && errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "poll failed");
+		if(p[1].revents & POLLIN){
+			uint64_t n;
+			const ssize_t r = ::read(d->wake, &n, sizeof(n));
+			(void) r;
+		}
+		// failures show up as watch_rescan in the batch
+		std::error_code ec;
+		process(ec);
+		if(take(b))
+			f(b);
+	}
+	d->stopping = false;
+}
+auto watcher::stop() -> void
+{
+	d->stopping = true;
+	const uint64_t one = 1;
+	const ssize_t r = write(d->wake, &one, sizeof(one));
+	(void) r;
+}
+#else
+struct watcher::impl{
+	Path root;
+};
+
+watcher::watcher(const Path& p, std::chrono::milliseconds debounce)
+	: watcher(cwd_dir(), p, debounce)
+{
+}
+watcher::watcher(const working_dir&, const Path& p, std::chrono::milliseconds)
+	: d(new impl{p})
+{
+	std::error_code ec;
+	set_error(ec, ENOSYS);
+	check(ec, "cannot watch ", p);
+}
+watcher::watcher(const working_dir&, const Path& p, std::chrono::milliseconds, std::error_code& ec)
+	: d(new impl{p})
+{
+	set_error(ec, ENOSYS);
+}
+watcher::~watcher()
+{
+}
+auto watcher::native_handle() const -> int
+{
+	return -1;
+}
+auto watcher::process() -> void
+{
+}
+auto watcher::process(std::error_code& ec) -> void
+{
+	ec.clear();
+}
+auto watcher::timeout() const -> int
+{
+	return -1;
+}
+auto watcher::take(std::vector<watch_event>&) -> bool
+{
+	return false;
+}
+auto watcher::run(const callback&) -> void
+{
+}
+auto watcher::stop() -> void
+{
+}
+#endif
+
 };
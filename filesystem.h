@@ -1,36 +1,108 @@
 #pragma once
 
 #include <ctime>
+#include <cstdint>
 #include <dirent.h>
 #include <sys/types.h>
 
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+// Paths up to FS_PATH_BUFSIZE-1 characters are stored inside the Path object
+// itself, longer ones spill to the heap.
+#ifndef FS_PATH_BUFSIZE
+#define FS_PATH_BUFSIZE 256
+#endif
+
+struct stat;
+#ifdef __linux__
+struct statx;
+#endif
 
 namespace boostfs{
 
+class Path;
+
+// Non-owning reference to (a part of) a path. It is only valid as long as
+// the Path it refers to is neither modified nor destroyed, and it is not
+// necessarily null-terminated.
+class path_view{
+	const char *ptr;
+	size_t len;
+
+public:
+	path_view();
+	path_view(const char *, size_t);
+	explicit path_view(const char *);
+	path_view(const Path&);
+
+	auto data() const -> const char*;
+	auto size() const -> size_t;
+	auto empty() const -> bool;
+	auto string() const -> std::string;
+
+	auto operator==(const path_view&) const -> bool;
+	auto operator!=(const path_view&) const -> bool;
+	auto operator==(const char *) const -> bool;
+	auto operator!=(const char *) const -> bool;
+};
+
 class Path{
-	std::string s;
+	static_assert(FS_PATH_BUFSIZE > 0, "FS_PATH_BUFSIZE must be positive");
+
+	char *buf;
+	size_t len;
+	size_t cap;
+	char sbuf[FS_PATH_BUFSIZE];
+
+	// offsets of the last separator and of the last dot after it, kept up
+	// to date by every modification so that const accessors do not write
+	size_t sep_pos;
+	size_t dot_pos;
+
+	auto scan(size_t from) -> void;
+	auto ext_pos() const -> size_t;
+	auto reserve(size_t n) -> void;
+	auto assign(const char *, size_t) -> void;
+	auto append(const char *, size_t) -> void;
+	auto truncate(size_t n) -> void;
 
 public:
 	Path();
-	Path(std::string);
+	Path(const std::string&);
 	Path(const char *);
+	Path(const char *, size_t);
+	Path(const path_view&);
 	Path(const Path&);
 	Path(Path&&);
+	~Path();
 	
 	auto operator+(const Path& p) const -> Path;
 	auto operator/(const Path& p) const -> Path;
 	auto operator==(const Path& p) const -> bool;
 	auto operator!=(const Path& p) const -> bool;
+	auto operator<(const Path& p) const -> bool;
 	auto filename() const -> Path;
 	auto extension() const -> Path;
 	auto stem() const -> Path;
 	auto parent_path() const -> Path;
+	auto filename_view() const -> path_view;
+	auto extension_view() const -> path_view;
+	auto stem_view() const -> path_view;
+	auto parent_path_view() const -> path_view;
+	auto lexically_normal() const -> Path;
 	auto clear() -> void;
 
 	auto empty() const -> bool;
 	auto size() const -> size_t;
-	auto string() const -> const std::string&;
+	// a copy, which allocates for long paths; c_str() and path_view refer
+	// to the path itself
+	auto string() const -> std::string;
 	auto c_str() const -> const char*;
 
 	auto operator=(const Path& p) -> Path&;
@@ -43,6 +115,7 @@ public:
 auto operator+(const std::string& s, const Path& p) -> Path;
 auto operator/(const std::string& s, const Path& p) -> Path;
 auto operator==(const std::string& s, const Path& p) -> bool;
+auto hash_value(const Path&) -> size_t;
 
 
 
@@ -55,24 +128,300 @@ auto canonical(const Path&) -> Path;
 auto is_regular_file(const Path&) -> bool;
 auto is_directory(const Path&) -> bool;
 auto last_write_time(const Path&) -> std::time_t;
-auto create_directory(const Path&) -> void;
+auto create_directory(const Path&) -> bool;
 auto current_path() -> Path;
 auto current_path(const Path&) -> void;
+// current_path() and complete() use a cached copy of the working directory,
+// which current_path(const Path&) keeps up to date. Call this after changing
+// the working directory by other means (e.g. chdir(2) directly).
+auto invalidate_current_path_cache() -> void;
+auto equivalent(const Path&, const Path&) -> bool;
+auto equivalence_classes(const std::vector<Path>&) -> std::vector<std::vector<Path>>;
+
+enum file_type{
+	status_error,
+	file_not_found,
+	regular_file,
+	directory_file,
+	symlink_file,
+	block_file,
+	character_file,
+	fifo_file,
+	socket_file,
+	type_unknown
+};
+
+// Parts of a file_status that status() needs to fetch. On Linux this is
+// passed on to statx, so file systems can skip attributes that are expensive
+// to obtain. The file type is always fetched.
+enum status_fields{
+	status_type = 0x01,
+	status_permissions = 0x02,
+	status_size = 0x04,
+	status_mtime = 0x08,
+	status_btime = 0x10,
+	status_ids = 0x20,
+	status_nlink = 0x40,
+	status_basic = 0x6f,
+	status_all = 0x7f
+};
+
+typedef std::chrono::time_point<std::chrono::system_clock, std::chrono::nanoseconds> file_time;
+
+// Result of a single stat call
+class file_status{
+	file_type t;
+	unsigned valid;
+	mode_t perms;
+	uintmax_t sz;
+	file_time mtime;
+	file_time btime;
+	dev_t dev;
+	ino_t ino;
+	nlink_t nlink;
+public:
+	file_status();
+	explicit file_status(file_type);
+	explicit file_status(const struct ::stat&);
+#ifdef __linux__
+	explicit file_status(const struct ::statx&);
+#endif
+
+	// status_fields that hold valid values
+	auto fields() const -> unsigned;
 
+	auto type() const -> file_type;
+	auto permissions() const -> mode_t;
+	auto size() const -> uintmax_t;
+	auto last_write_time() const -> file_time;
+	auto creation_time() const -> file_time;
+	auto device() const -> dev_t;
+	auto inode() const -> ino_t;
+	auto hard_link_count() const -> nlink_t;
+};
+
+auto status(const Path&, unsigned fields = status_basic) -> file_status;
+auto symlink_status(const Path&, unsigned fields = status_basic) -> file_status;
+auto exists(const file_status&) -> bool;
+auto is_regular_file(const file_status&) -> bool;
+auto is_directory(const file_status&) -> bool;
+auto is_symlink(const file_status&) -> bool;
+auto is_symlink(const Path&) -> bool;
+
+// A directory that relative paths are resolved against, so that each thread
+// (or object) can have its own working directory. Absolute paths ignore it.
+// A default constructed working_dir refers to the process' current directory.
+// Iterators and entries created relative to it share its descriptor, which
+// is closed when the last of them is gone.
+class working_dir{
+	int fd;
+	// owns fd unless it is AT_FDCWD or invalid
+	std::shared_ptr<const int> owner;
+
+	friend class directory_iterator;
+	friend class recursive_directory_iterator;
+	friend class async_walker;
+	auto open(const working_dir&, const Path&, std::error_code&) -> void;
+public:
+	working_dir();
+	explicit working_dir(const Path&);
+	working_dir(const working_dir&, const Path&);
+	working_dir(const Path&, std::error_code&);
+	working_dir(const working_dir&, const Path&, std::error_code&);
+	working_dir(const working_dir&) = delete;
+	working_dir(working_dir&&);
+	~working_dir();
+	auto operator=(const working_dir&) -> working_dir& = delete;
+	auto operator=(working_dir&&) -> working_dir&;
+
+	auto native_handle() const -> int;
+};
+
+auto status(const working_dir&, const Path&, unsigned fields = status_basic) -> file_status;
+auto symlink_status(const working_dir&, const Path&, unsigned fields = status_basic) -> file_status;
+// Like calling status() for every path, but on Linux the requests are
+// batched through io_uring. out must have room for n results.
+auto status_many(const Path *, size_t n, file_status *out, unsigned fields = status_basic) -> void;
+auto status_many(const working_dir&, const Path *, size_t n, file_status *out, unsigned fields = status_basic) -> void;
+auto status_many(const std::vector<Path>&, unsigned fields = status_basic) -> std::vector<file_status>;
+// Like status_many(), but spreads the calls over a number of threads (by
+// default one per CPU), which pays off when each call has to wait for the
+// file system, e.g. on NFS or FUSE mounts.
+auto status_parallel(const Path *, size_t n, file_status *out, unsigned threads = 0, unsigned fields = status_basic) -> void;
+auto status_parallel(const working_dir&, const Path *, size_t n, file_status *out, unsigned threads = 0, unsigned fields = status_basic) -> void;
+auto status_parallel(const std::vector<Path>&, unsigned threads = 0, unsigned fields = status_basic) -> std::vector<file_status>;
+auto exists(const working_dir&, const Path&) -> bool;
+auto remove(const working_dir&, const Path&) -> bool;
+auto remove_all(const working_dir&, const Path&) -> bool;
+auto is_regular_file(const working_dir&, const Path&) -> bool;
+auto is_directory(const working_dir&, const Path&) -> bool;
+auto is_symlink(const working_dir&, const Path&) -> bool;
+auto last_write_time(const working_dir&, const Path&) -> std::time_t;
+auto create_directory(const working_dir&, const Path&) -> bool;
+
+// Variants that report failures through ec instead of throwing, and do not
+// allocate on failure. ec is cleared on success.
+auto status(const Path&, std::error_code&) -> file_status;
+auto status(const Path&, unsigned fields, std::error_code&) -> file_status;
+auto symlink_status(const Path&, std::error_code&) -> file_status;
+auto symlink_status(const Path&, unsigned fields, std::error_code&) -> file_status;
+auto exists(const Path&, std::error_code&) -> bool;
+auto remove(const Path&, std::error_code&) -> bool;
+auto remove_all(const Path&, std::error_code&) -> bool;
+auto complete(const Path&, std::error_code&) -> Path;
+auto canonical(const Path&, std::error_code&) -> Path;
+auto is_regular_file(const Path&, std::error_code&) -> bool;
+auto is_directory(const Path&, std::error_code&) -> bool;
+auto is_symlink(const Path&, std::error_code&) -> bool;
+auto last_write_time(const Path&, std::error_code&) -> std::time_t;
+auto create_directory(const Path&, std::error_code&) -> bool;
+auto current_path(std::error_code&) -> Path;
+auto current_path(const Path&, std::error_code&) -> void;
+auto equivalent(const Path&, const Path&, std::error_code&) -> bool;
+
+auto status(const working_dir&, const Path&, std::error_code&) -> file_status;
+auto status(const working_dir&, const Path&, unsigned fields, std::error_code&) -> file_status;
+auto symlink_status(const working_dir&, const Path&, std::error_code&) -> file_status;
+auto symlink_status(const working_dir&, const Path&, unsigned fields, std::error_code&) -> file_status;
+auto exists(const working_dir&, const Path&, std::error_code&) -> bool;
+auto remove(const working_dir&, const Path&, std::error_code&) -> bool;
+auto remove_all(const working_dir&, const Path&, std::error_code&) -> bool;
+auto is_regular_file(const working_dir&, const Path&, std::error_code&) -> bool;
+auto is_directory(const working_dir&, const Path&, std::error_code&) -> bool;
+auto is_symlink(const working_dir&, const Path&, std::error_code&) -> bool;
+auto last_write_time(const working_dir&, const Path&, std::error_code&) -> std::time_t;
+auto create_directory(const working_dir&, const Path&, std::error_code&) -> bool;
+
+auto exists(const path_view&) -> bool;
+auto remove(const path_view&) -> bool;
+auto is_regular_file(const path_view&) -> bool;
+auto is_directory(const path_view&) -> bool;
+auto last_write_time(const path_view&) -> std::time_t;
+
+class directory_iterator;
+class recursive_directory_iterator;
+class dir_handle;
+class async_walker;
+class parallel_walker;
+class ordered_walker;
+
+enum directory_order{
+	readdir_order,
+	inode_order,
+};
+
+// The file type is taken from readdir where the file system provides it, so
+// the type queries usually need no syscall. Otherwise the status is fetched
+// once and cached.
+// While their directory_iterator still has the directory open, entries
+// access the file relative to it, by name only. This saves the kernel from
+// walking the whole path again and also works for paths longer than
+// PATH_MAX. Entries do not keep the directory open themselves; once it is
+// closed they use their path, relative to the working_dir they were read
+// from.
 class directory_entry{
+	// where the file is accessed from; dir is kept alive while in use
+	struct location{
+		std::shared_ptr<dir_handle> dir;
+		int fd;
+		const char *name;
+	};
+
 	Path p;
+	std::weak_ptr<dir_handle> dir;
+	// descriptor of the working_dir p is relative to, null for AT_FDCWD
+	std::shared_ptr<const int> base;
+	size_t name;
+	ino_t ino;
+	mutable file_type t;
+	mutable file_status st;
+	mutable bool st_valid;
+
+	friend class directory_iterator;
+	friend class recursive_directory_iterator;
+	friend class async_walker;
+	friend class parallel_walker;
+	friend class ordered_walker;
+	friend auto read_directory(const working_dir&, const Path&, directory_order, bool, std::error_code&) -> std::vector<directory_entry>;
+	directory_entry(const std::shared_ptr<dir_handle>&, const std::shared_ptr<const int>& base, const Path&, size_t name, file_type, ino_t);
+	auto known_type() const -> file_type;
+	auto locate() const -> location;
+	// the directory, while it is open; holding it keeps the entry using it
+	auto handle() const -> std::shared_ptr<dir_handle>;
 public:
 	explicit directory_entry(const Path&);
 	auto path() const -> const Path&;
+	auto inode() const -> ino_t;
+	// a failed lookup yields file_not_found or status_error and is not
+	// cached; the overloads with ec report why it failed
+	auto status() const -> file_status;
+	auto status(std::error_code&) const -> file_status;
+	auto symlink_status() const -> file_status;
+	auto symlink_status(std::error_code&) const -> file_status;
+	auto is_regular_file() const -> bool;
+	auto is_directory() const -> bool;
+	auto is_symlink() const -> bool;
+
+	auto remove() const -> bool;
+	auto remove(std::error_code&) const -> bool;
+	// iterates over this directory; symlinks are not followed
+	auto open_subdir() const -> directory_iterator;
+	auto open_subdir(std::error_code&) const -> directory_iterator;
 };
 
+// Selects directory entries by their raw name and type (type_unknown if
+// the file system does not report it), before a Path is built for them.
+// "." and ".." are never selected.
+class name_filter{
+public:
+	typedef std::function<bool(const char *name, file_type)> predicate;
+private:
+	predicate f;
+public:
+	// everything but "." and ".."
+	name_filter();
+	name_filter(const predicate&);
+	// names whose extension, as returned by Path::extension(), is one of
+	// exts, e.g. {".o", ".a"}. "" selects names without an extension.
+	static auto extensions(const std::vector<std::string>& exts) -> name_filter;
+	static auto prefix(const std::string&) -> name_filter;
+	// whole name against a pattern with *, ?, [...] and \ escapes. A leading
+	// dot is not treated specially.
+	static auto glob(const std::string&) -> name_filter;
+
+	auto operator()(const char *name, file_type) const -> bool;
+};
+
+// On Linux the entries are read with getdents64 into a buffer whose size
+// can be chosen per iterator; subdirectories opened from its entries use the
+// same size. Elsewhere readdir is used.
+// With a name_filter, rejected entries are skipped while reading.
 class directory_iterator{
-	DIR *dir;
-	dirent *dp;
+	std::shared_ptr<dir_handle> dir;
+	// descriptor of the working_dir p is relative to, null for AT_FDCWD
+	std::shared_ptr<const int> base;
+	const char *name;
+	file_type type;
+	ino_t ino;
 	Path p;
+	name_filter::predicate filter;
+
+	friend class directory_entry;
+	friend class recursive_directory_iterator;
+	auto open(int fd, const char *name, int flags, size_t buffer_size, std::error_code&) -> void;
 public:
+	static constexpr size_t default_buffer_size = 32768;
+
 	directory_iterator();
 	directory_iterator(const Path&);
+	directory_iterator(const working_dir&, const Path&);
+	directory_iterator(const Path&, std::error_code&);
+	directory_iterator(const working_dir&, const Path&, std::error_code&);
+	directory_iterator(const working_dir&, const Path&, size_t buffer_size);
+	directory_iterator(const working_dir&, const Path&, size_t buffer_size, std::error_code&);
+	directory_iterator(const Path&, const name_filter&);
+	directory_iterator(const working_dir&, const Path&, const name_filter&);
+	directory_iterator(const working_dir&, const Path&, const name_filter&, std::error_code&);
 	directory_iterator(const directory_iterator&) = delete;
 	directory_iterator(directory_iterator&&);
 	~directory_iterator();
@@ -80,11 +429,264 @@ public:
 	auto operator=(directory_iterator&&) -> directory_iterator&;
 
 	auto operator++() -> directory_iterator&;
+	auto increment(std::error_code&) -> directory_iterator&;
 	auto operator*() const -> directory_entry;
 	auto operator==(const directory_iterator&) const -> bool;
 	auto operator!=(const directory_iterator&) const -> bool;
 
+	// file descriptor of the directory, -1 at the end
+	auto native_handle() const -> int;
+};
+
+// Reads all entries of p except "." and "..". inode_order sorts them by
+// inode number, which on most file systems follows the layout of the inode
+// table. With with_status, symlink_status() is then fetched in that order,
+// avoiding random seeks on rotating disks and cold caches. The directory
+// stays open for that, so the lookups are relative to it. If one fails, the
+// first error is reported and the entries are still returned.
+auto read_directory(const Path&, directory_order = readdir_order, bool with_status = false) -> std::vector<directory_entry>;
+auto read_directory(const working_dir&, const Path&, directory_order = readdir_order, bool with_status = false) -> std::vector<directory_entry>;
+auto read_directory(const working_dir&, const Path&, directory_order, bool with_status, std::error_code&) -> std::vector<directory_entry>;
+
+// The entries of a directory, except "." and "..", as they were when it was
+// read. All names are kept null-terminated in one buffer and described by
+// small fixed-size records, so a snapshot takes two allocations and reading
+// it again reuses them. The directory is not kept open.
+class directory_snapshot{
+	struct record{
+		uint32_t offset;
+		uint16_t length;
+		uint8_t type;
+		ino_t ino;
+	};
+	Path dir;
+	std::vector<char> names;
+	std::vector<record> recs;
+public:
+	struct entry{
+		path_view name;
+		file_type type;
+		ino_t ino;
+	};
+	class const_iterator{
+		const directory_snapshot *s;
+		size_t i;
+
+		friend class directory_snapshot;
+		const_iterator(const directory_snapshot *, size_t);
+	public:
+		auto operator*() const -> entry;
+		auto operator++() -> const_iterator&;
+		auto operator==(const const_iterator&) const -> bool;
+		auto operator!=(const const_iterator&) const -> bool;
+	};
+
+	directory_snapshot();
+	directory_snapshot(const Path&);
+	directory_snapshot(const working_dir&, const Path&);
+	directory_snapshot(const working_dir&, const Path&, std::error_code&);
+
+	// replaces the contents; empty on error
+	auto read(const working_dir&, const Path&, std::error_code&) -> void;
+
+	auto directory() const -> const Path&;
+	auto size() const -> size_t;
+	auto empty() const -> bool;
+	auto operator[](size_t) const -> entry;
+	// directory() / name of entry i
+	auto path(size_t) const -> Path;
+	auto begin() const -> const_iterator;
+	auto end() const -> const_iterator;
+
+	// reorder the records; the names stay where they are
+	auto sort_by_name() -> void;
+	auto sort_by_inode() -> void;
+};
+
+struct tree_changes{
+	std::vector<Path> added;
+	std::vector<Path> removed;
+	// non-directories whose inode stayed but whose size or mtime changed
+	std::vector<Path> modified;
+};
+
+// Type, inode, size and mtime of everything below a directory, without
+// following symlinks, for finding out what changed since the last scan.
+// A directory's mtime only changes when entries are added, removed or
+// renamed in it, so update() does not read directories whose inode and
+// mtime are unchanged, nor stat the files in them; only their
+// subdirectories are checked. That costs one stat per directory, but misses
+// files modified in place unless recheck_files is set. Directories modified
+// around the time of the last scan are read again anyway, as a change in
+// the same timestamp tick would not show.
+class tree_snapshot{
+	struct node{
+		file_type type;
+		ino_t ino;
+		uintmax_t size;
+		file_time mtime;
+		// names of the entries of a directory
+		std::vector<std::string> children;
+	};
+	struct scan;
+	// the constructor's working_dir, opened again for update() without one
+	working_dir wd;
+	Path top;
+	// by path relative to top, which is ""
+	std::unordered_map<std::string, node> nodes;
+	// when the last update() started, less the timestamp granularity
+	file_time scanned;
+public:
+	tree_snapshot();
+	tree_snapshot(const Path&);
+	tree_snapshot(const working_dir&, const Path&);
+	tree_snapshot(const working_dir&, const Path&, std::error_code&);
+
+	auto root() const -> const Path&;
+	// number of files and directories, including the root
+	auto size() const -> size_t;
+
+	// scans the tree again and returns the differences. Unreadable
+	// directories are kept as they were; the first error is reported after
+	// the rest has been scanned. If the root itself cannot be found or
+	// read, nothing changes. Without a working_dir, the directory given to
+	// the constructor is used, even if that working_dir is gone.
+	auto update(bool recheck_files = false) -> tree_changes;
+	auto update(const working_dir&, bool recheck_files = false) -> tree_changes;
+	auto update(const working_dir&, bool recheck_files, std::error_code&) -> tree_changes;
+};
+
+// Walks a tree depth-first, without following symlinks and skipping "." and
+// "..". Each level keeps its directory open, but at most max_open of them:
+// when descending further, the remaining entries of the shallowest open
+// level are read into memory and its directory is closed. Entries of such
+// a level are accessed by their path relative to the working_dir.
+class recursive_directory_iterator{
+	struct state;
+	std::unique_ptr<state> s;
+public:
+	static constexpr unsigned default_max_open = 32;
+
+	recursive_directory_iterator();
+	recursive_directory_iterator(const Path&);
+	recursive_directory_iterator(const working_dir&, const Path&, unsigned max_open = default_max_open);
+	recursive_directory_iterator(const Path&, std::error_code&);
+	recursive_directory_iterator(const working_dir&, const Path&, std::error_code&);
+	recursive_directory_iterator(const working_dir&, const Path&, unsigned max_open, std::error_code&);
+	recursive_directory_iterator(const recursive_directory_iterator&) = delete;
+	recursive_directory_iterator(recursive_directory_iterator&&);
+	~recursive_directory_iterator();
+	auto operator=(const recursive_directory_iterator&) -> recursive_directory_iterator& = delete;
+	auto operator=(recursive_directory_iterator&&) -> recursive_directory_iterator&;
+
+	auto operator++() -> recursive_directory_iterator&;
+	auto increment(std::error_code&) -> recursive_directory_iterator&;
+	auto operator*() const -> const directory_entry&;
+	auto operator==(const recursive_directory_iterator&) const -> bool;
+	auto operator!=(const recursive_directory_iterator&) const -> bool;
+
+	// 0 for entries of the directory the iterator was created with
+	auto depth() const -> int;
+	auto recursion_pending() const -> bool;
+	// do not descend into the current entry on the next increment
+	auto disable_recursion_pending() -> void;
+	// continue with the next entry of the parent directory
+	auto pop() -> void;
+	auto pop(std::error_code&) -> void;
+};
+
+// Calls f for every entry below p, without following symlinks and skipping
+// "." and "..". Directories are read by a number of threads (by default
+// hardware_concurrency) that steal work from each other, so f is called
+// concurrently and in no particular order. With with_status, the entry's
+// symlink_status() is fetched before f is called. Unreadable directories
+// are skipped; the first such error is reported once the walk is done.
+// An exception thrown by f stops the walk and is rethrown.
+typedef std::function<void(const directory_entry&)> walk_callback;
+auto walk_parallel(const Path&, const walk_callback& f, unsigned threads = 0, bool with_status = false) -> void;
+auto walk_parallel(const working_dir&, const Path&, const walk_callback& f, unsigned threads = 0, bool with_status = false) -> void;
+auto walk_parallel(const working_dir&, const Path&, const walk_callback& f, unsigned threads, bool with_status, std::error_code&) -> void;
+// Like walk_parallel(), but f is only called from the calling thread, in
+// depth-first order with the entries of each directory sorted by name, so
+// the sequence of calls is the same on every run. Worker threads read and
+// sort directories ahead of the caller, at most read_ahead of them.
+auto walk_parallel_ordered(const Path&, const walk_callback& f, unsigned threads = 0, bool with_status = false, size_t read_ahead = 256) -> void;
+auto walk_parallel_ordered(const working_dir&, const Path&, const walk_callback& f, unsigned threads = 0, bool with_status = false, size_t read_ahead = 256) -> void;
+auto walk_parallel_ordered(const working_dir&, const Path&, const walk_callback& f, unsigned threads, bool with_status, size_t read_ahead, std::error_code&) -> void;
+// Like walk_parallel(), but from a single thread that keeps many opens and
+// stats in flight through io_uring; f is called in no particular order.
+// Without io_uring this is a sequential walk.
+auto walk_async(const Path&, const walk_callback& f, bool with_status = false) -> void;
+auto walk_async(const working_dir&, const Path&, const walk_callback& f, bool with_status = false) -> void;
+auto walk_async(const working_dir&, const Path&, const walk_callback& f, bool with_status, std::error_code&) -> void;
+
+enum watch_flags{
+	watch_created = 1,
+	watch_removed = 2,
+	// contents or attributes
+	watch_modified = 4,
+	// events below the path were lost, it has to be scanned again
+	watch_rescan = 8,
+};
+
+// flags combines everything that happened to path within one batch
+struct watch_event{
+	Path path;
+	unsigned flags;
+};
+
+// Watches a tree for changes with inotify; elsewhere construction fails
+// with ENOSYS. Events are collected until the tree has been quiet for
+// debounce, but for at most ten times that, and then delivered as a batch
+// with one watch_event per path. Directories are watched as they appear,
+// and what they already contain is reported as created. If the kernel's
+// event queue overflows, all watches are set up again and the batch
+// contains watch_rescan for the root.
+//
+// Either call run(), or poll native_handle() for reading with a timeout of
+// timeout() milliseconds, then call process() and take().
+class watcher{
+	struct impl;
+	std::unique_ptr<impl> d;
+public:
+	typedef std::function<void(std::vector<watch_event>&)> callback;
+
+	watcher(const Path&, std::chrono::milliseconds debounce = std::chrono::milliseconds(50));
+	watcher(const working_dir&, const Path&, std::chrono::milliseconds debounce = std::chrono::milliseconds(50));
+	// on failure native_handle() is -1 and no events are delivered
+	watcher(const working_dir&, const Path&, std::chrono::milliseconds debounce, std::error_code&);
+	watcher(const watcher&) = delete;
+	~watcher();
+	auto operator=(const watcher&) -> watcher& = delete;
+
+	auto native_handle() const -> int;
+	// reads the events that are available without blocking. Directories
+	// that cannot be watched are reported with watch_rescan, the first
+	// such error is returned.
+	auto process() -> void;
+	auto process(std::error_code&) -> void;
+	// milliseconds until the current batch is due, -1 if there is none
+	auto timeout() const -> int;
+	// moves the current batch to out if it is due
+	auto take(std::vector<watch_event>& out) -> bool;
+	// delivers batches to f until stop() is called, from f or another
+	// thread. Errors while watching only show up as watch_rescan; if
+	// polling itself fails, std::system_error is thrown.
+	auto run(const callback& f) -> void;
+	auto stop() -> void;
 };
 
 typedef Path path;
 };
+
+namespace std{
+
+template<>
+struct hash<boostfs::Path>{
+	auto operator()(const boostfs::Path& p) const -> size_t
+	{
+		return boostfs::hash_value(p);
+	}
+};
+
+};